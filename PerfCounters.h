@@ -0,0 +1,171 @@
+#pragma once
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+namespace Impl::PerfCounters
+{
+	[[nodiscard]] constexpr
+	uint64_t cache_event(const uint64_t cache, const uint64_t op, const uint64_t result) {
+		return cache | (op << 8) | (result << 16);
+	}
+}
+
+/* Hardware performance counters around a section of code, using `perf_event_open(2)`.
+ * The counters are opened for the calling thread with `inherit` set, so they must be
+ * opened before the measured threads are spawned; the counts of child threads are folded
+ * into the parent's counters when the threads exit, so read them after joining.
+ * When perf is unavailable (no kernel support, restrictive `perf_event_paranoid`,
+ * containers, virtual machines without a PMU) the affected counters report "n/a".
+ */
+class PerfCounters
+{
+private:
+	struct Event {
+		const char *name;
+		uint32_t type;
+		uint64_t config;
+	};
+	
+	struct Reading {
+		uint64_t value;
+		uint64_t timeEnabled;
+		uint64_t timeRunning;
+	};
+	
+#ifdef __linux__
+	constexpr static std::array EVENTS = {
+		Event{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		Event{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		Event{ "L1d-load-misses", PERF_TYPE_HW_CACHE, ::Impl::PerfCounters::cache_event(
+			PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS
+		) },
+		Event{ "LLC-load-misses", PERF_TYPE_HW_CACHE, ::Impl::PerfCounters::cache_event(
+			PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS
+		) },
+		// generic "cache-misses" includes misses served by another core's cache on most PMUs
+		Event{ "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		// remote-node accesses; only counts cache-line transfers across sockets
+		Event{ "node-load-misses", PERF_TYPE_HW_CACHE, ::Impl::PerfCounters::cache_event(
+			PERF_COUNT_HW_CACHE_NODE, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS
+		) },
+		Event{ "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	};
+#else
+	constexpr static std::array<Event, 0> EVENTS = {};
+#endif
+	
+	std::array<int, EVENTS.size()> m_fds;
+	std::array<Reading, EVENTS.size()> m_readings;
+	int m_openErrno;
+	
+	
+	[[nodiscard]] static int _open(const Event &event) {
+#ifdef __linux__
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof (attr));
+		attr.size = sizeof (attr);
+		attr.type = event.type;
+		attr.config = event.config;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		// context switches happen in the kernel, so excluding it would always read 0
+		attr.exclude_kernel = (event.type != PERF_TYPE_SOFTWARE);
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+		(void)event;
+		errno = ENOSYS;
+		return -1;
+#endif
+	}
+	
+	template<typename Fn>
+	void _for_each_open(Fn &&fn) {
+		for (size_t i = 0; i < m_fds.size(); ++i) {
+			if (m_fds[i] >= 0) { fn(i, m_fds[i]); }
+		}
+	}
+public:
+	PerfCounters()
+		: m_fds{}
+		, m_readings{}
+		, m_openErrno{ 0 }
+	{
+		for (size_t i = 0; i < EVENTS.size(); ++i) {
+			m_fds[i] = _open(EVENTS[i]);
+			if (m_fds[i] < 0 && m_openErrno == 0) { m_openErrno = errno; }
+		}
+	}
+	
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+	
+	~PerfCounters() {
+#ifdef __linux__
+		_for_each_open([](size_t, int fd) { close(fd); });
+#endif
+	}
+	
+	[[nodiscard]] bool available() const {
+		for (const int fd : m_fds) {
+			if (fd >= 0) { return true; }
+		}
+		return false;
+	}
+	
+	void start() {
+#ifdef __linux__
+		_for_each_open([](size_t, int fd) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		});
+#endif
+	}
+	
+	void stop() {
+#ifdef __linux__
+		_for_each_open([this](size_t i, int fd) {
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fd, &m_readings[i], sizeof (Reading)) != sizeof (Reading)) {
+				m_readings[i] = Reading{};
+			}
+		});
+#endif
+	}
+	
+	/* Print every counter divided by `nOps`, scaled up when the kernel had to multiplex. */
+	void print(const size_t nOps) const {
+		if (!available()) {
+			printf("Performance counters unavailable: \e[90m%s\e[m\n", strerror(m_openErrno));
+			return;
+		}
+		
+		printf("Performance counters per operation (%'zu operations):\n", nOps);
+		for (size_t i = 0; i < EVENTS.size(); ++i) {
+			const Reading &reading = m_readings[i];
+			if (m_fds[i] < 0 || reading.timeRunning == 0) {
+				printf("  %-18s \e[90mn/a\e[m\n", EVENTS[i].name);
+				continue;
+			}
+			
+			const double scale = double(reading.timeEnabled) / double(reading.timeRunning);
+			const double total = double(reading.value) * scale;
+			printf("  %-18s \e[93m%12.3f\e[m  (total: %'.0f%s)\n",
+				EVENTS[i].name, total / double(nOps), total,
+				(scale > 1.0) ? ", multiplexed" : ""
+			);
+		}
+	}
+};
@@ -1,9 +1,23 @@
 #include "DataSource.h"
+#include "PerfCounters.h"
+#include "queue_impls/AsyncQueue.h"
+#include "queue_impls/PollableQueue.h"
+#include "queue_impls/DurableQueue.h"
 #include "queue_impls/Queue_1Lock.h"
 #include "queue_impls/Queue_1LockSharded.h"
+#include "queue_impls/Queue_1LockShardedUnlimited.h"
 #include "queue_impls/Queue_2Lock.h"
 #include "queue_impls/Queue_2LockSharded.h"
+#include "queue_impls/Queue_2LockShardedUnlimited.h"
+#include "queue_impls/Queue_AdaptiveSharded.h"
+#include "queue_impls/Queue_NumaSharded.h"
 #include "queue_impls/Queue_SplitSharded.h"
+#include <algorithm>
+#include <filesystem>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
 
 
 struct Key { std::string _; };
@@ -14,8 +28,45 @@ template<> struct std::hash<Key> {
 	}
 };
 
+template<> struct Utils::Serializer<Key> {
+	static void write(std::string &out, const Key &key) { Serializer<std::string>::write(out, key._); }
+	static bool read(const char *&pos, const char *end, Key &key) {
+		return Serializer<std::string>::read(pos, end, key._);
+	}
+};
+
+/* The ids of 'DataSource.h' have 16 hex digits, so they also fit in a fixed-size key
+ * which the queues can store inline, see 'FlatDedupQueue.h'. */
+struct FixedKey {
+	std::array<char, 16> _;
+	
+	FixedKey() = default;
+	FixedKey(const std::string_view str) : _{} { str.copy(_.data(), _.size()); }
+};
+inline bool operator==(const FixedKey &a, const FixedKey &b) { return a._ == b._; }
+inline bool operator<(const FixedKey &a, const FixedKey &b) { return a._ < b._; }
+template<> struct std::hash<FixedKey> {
+	size_t operator()(const FixedKey &self) const noexcept {
+		return std::hash<std::string_view>{}({ self._.data(), self._.size() });
+	}
+};
+
+[[nodiscard]] static std::string key_string(const Key &key) { return key._; }
+[[nodiscard]] static std::string key_string(const FixedKey &key) {
+	return std::string{ key._.data(), strnlen(key._.data(), key._.size()) };
+}
+
 struct Value { int64_t _; };
 
+/* Passes extra constructor arguments after the capacity, e.g. the shard count. */
+template<typename Queue, usize ...ARGS>
+struct Configured : public Queue
+{
+	Configured(const usize capacity)
+		: Queue{ capacity, ARGS... }
+	{}
+};
+
 
 constexpr static void check__impl(const bool passed, const size_t line, const char *msg) {
 	assert(msg != nullptr);
@@ -34,14 +85,16 @@ constexpr static void check__impl(const bool passed, const size_t line, const ch
 #define check_reachable_false() \
 	check__impl(false, __LINE__, "check_reachable()")
 
+template<typename Key>
 static void print_kvpair(const std::pair<Key, Value> &pair) {
 	printf("std::pair<Key, Value>{ \e[94mkey\e[m: \e[96m%s\e[m, \e[94mvalue\e[m: \e[96m%ld\e[m }\n",
-		pair.first._.c_str(), pair.second._
+		key_string(pair.first).c_str(), pair.second._
 	);
 }
 
 template<typename Queue>
 static void test() {
+	using Key = typename Queue::key_type;
 	Queue queue{ 2 };
 	
 	check_true(queue.size() == 0);
@@ -50,12 +103,13 @@ static void test() {
 	check_true(queue.size() == 1);
 	check_true(queue.try_write(Key{ "2" }, Value{ 34905 }));
 	check_true(queue.size() == 2);
-	check_true(!queue.try_write(Key{ "3" }, Value{ -34905 }));
+	check_true(queue.try_write(Key{ "3" }, Value{ -34905 }) != Queue::BOUNDED);
 	
 	print_kvpair(queue.read());
-	check_true(queue.size() == 1);
+	check_true(queue.size() == 1 + !Queue::BOUNDED);
 	print_kvpair(queue.read());
-	check_true(queue.size() == 0);
+	check_true(queue.size() == 0 + !Queue::BOUNDED);
+	if constexpr (!Queue::BOUNDED) { print_kvpair(queue.read()); }
 	
 	queue.stop();
 	try {
@@ -67,23 +121,786 @@ static void test() {
 	try {
 		check_true(queue.try_write(Key{ "859" }, Value{ 69821 }));
 		check_true(queue.try_write(Key{ "312" }, Value{ 9752 }));
-		check_true(!queue.try_write(Key{ "592" }, Value{ 5823 }));
-		check_true(!queue.try_write(Key{ "4124" }, Value{ 978736 }));
+		check_true(queue.try_write(Key{ "592" }, Value{ 5823 }) != Queue::BOUNDED);
+		check_true(queue.try_write(Key{ "4124" }, Value{ 978736 }) != Queue::BOUNDED);
 		check_true(queue.try_write(Key{ "312" }, Value{ 21 }));
 		check_reachable_true();
 	}
 	catch (const Utils::queue_stopped_exception&) {
 		check_reachable_false();
 	}
+	
+	const std::string snapshotPath = std::filesystem::temp_directory_path() / "queue-test.snapshot";
+	queue.snapshot(snapshotPath);
+	Queue restored{ 2 };
+	check_true(restored.restore(snapshotPath) == queue.size());
+	check_true(restored.size() == queue.size());
+	std::map<std::string, int64_t> original, copy;
+	while (queue.size() > 0) {
+		auto [key, value] = queue.read();
+		original.emplace(key_string(key), value._);
+	}
+	while (restored.size() > 0) {
+		auto [key, value] = restored.read();
+		copy.emplace(key_string(key), value._);
+	}
+	check_true(original == copy);
+	std::filesystem::remove(snapshotPath);
+}
+
+/* Checks that every group compare the CPU supports agrees with the scalar one. */
+static void test_match_group() {
+	namespace Flat = Impl::FlatDedupQueue;
+	printf("Dedup probes use: \e[96m%s\e[m\n", Flat::isa_name(Flat::isa_for_cpu()));
+	
+	std::vector<decltype(&Flat::match_group_scalar)> impls;
+#if defined(__SSE2__)
+	impls.push_back(Flat::match_group_sse2);
+	if (__builtin_cpu_supports("avx2")) { impls.push_back(Flat::match_group_avx2); }
+#endif
+	
+	std::mt19937 rng{ 0 };
+	std::array<uint8_t, Flat::GROUP_SIZE> ctrl;
+	size_t nMismatches = 0;
+	for (size_t i = 0; i < 4096; ++i) {
+		for (uint8_t &byte : ctrl) {
+			const uint32_t choice = rng() % 8;
+			byte = (choice == 0) ? Flat::EMPTY : (choice == 1) ? Flat::DELETED : uint8_t(rng() % 4);
+		}
+		const uint8_t fingerprint = rng() % 4;
+		const Flat::GroupMasks expected = Flat::match_group_scalar(ctrl.data(), fingerprint);
+		for (const auto impl : impls) {
+			const Flat::GroupMasks masks = impl(ctrl.data(), fingerprint);
+			nMismatches += (masks.match != expected.match || masks.empty != expected.empty
+				|| masks.free != expected.free);
+		}
+	}
+	check_true(nMismatches == 0);
+}
+
+/* Sequential integers hash to themselves, and to a fixed shard in their low bits when they
+ * are strided by the shard count, neither may cluster the probe sequences of the flat table. */
+static void test_flat_sequential_keys() {
+	constexpr uint64_t N_KEYS = (1 << 18);
+	for (const uint64_t stride : { 1, 64 }) {
+		Utils::FlatDedupQueue<uint64_t, Value> queue;
+		const auto tpStart = chrono::steady_clock::now();
+		for (uint64_t i = 0; i < N_KEYS; ++i) { queue.insert_or_assign(i * stride, Value{ int64_t(i) }); }
+		size_t nMissing = 0;
+		for (uint64_t i = 0; i < N_KEYS; ++i) { nMissing += (queue.find(i * stride) == nullptr); }
+		const auto elapsed = Utils::to_milli(chrono::steady_clock::now() - tpStart);
+		printf("Stride %zu: %'ld ms for %'zu keys.\n", size_t(stride), long(elapsed.count()), size_t(N_KEYS));
+		
+		check_true(nMissing == 0);
+		check_true(queue.size() == N_KEYS);
+		check_true(elapsed < chrono::seconds{ 2 }); // clustered probes take several seconds
+		bool fifo = true;
+		for (uint64_t i = 0; i < N_KEYS; ++i) { fifo &= (queue.pop().first == i * stride); }
+		check_true(fifo);
+	}
 }
 
+template<typename Queue, typename = void>
+struct has_snapshot : std::false_type {};
+
+template<typename Queue>
+struct has_snapshot<Queue, std::void_t<decltype(
+	std::declval<Queue&>().restore(std::declval<const std::string&>())
+)>> : std::true_type {};
+
+template<typename Queue, typename = void>
+struct has_sorted_read : std::false_type {};
+
 template<typename Queue>
+struct has_sorted_read<Queue, std::void_t<decltype(
+	std::declval<Queue&>().read_sorted_batch(usize{ 1 })
+)>> : std::true_type {};
+
+// the inline table isn't ordered, so the queues that store keys inline have no key-ordered reads
+static_assert(has_sorted_read<Queue_1Lock<Key, Value>>::value && !has_sorted_read<Queue_1Lock<FixedKey, Value>>::value);
+static_assert(has_sorted_read<Queue_1LockSharded<Key, Value>>::value
+	&& !has_sorted_read<Queue_1LockSharded<FixedKey, Value>>::value);
+
+#if __cplusplus >= 202002L
+/* Coroutine which starts right away and isn't awaited, enough to drive the awaiters. */
+struct DetachedTask {
+	struct promise_type {
+		DetachedTask get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/* Checks that suspended readers are resumed by writers and suspended writers by readers,
+ * inline or through an executor, and that `stop()` resumes every waiter. */
+template<typename Queue>
+static void test_async() {
+	using Key = typename Queue::key_type;
+	
+	AsyncQueue<Queue> queue{ 2 };
+	std::vector<std::string> delivered;
+	bool stopped = false;
+	const auto consume = [&delivered, &stopped](AsyncQueue<Queue> &queue) -> DetachedTask {
+		try {
+			while (true) {
+				auto [key, value] = co_await queue.async_read();
+				delivered.push_back(key_string(key));
+			}
+		}
+		catch (const Utils::queue_stopped_exception&) {
+			stopped = true;
+		}
+	};
+	consume(queue);
+	check_true(delivered.empty());
+	check_true(queue.try_write(Key{ "1" }, Value{ 1 }));
+	check_true(delivered.size() == 1 && delivered.back() == "1");
+	check_true(queue.size() == 0);
+	
+	if constexpr (Queue::BOUNDED) {
+		AsyncQueue<Queue> full{ 2 };
+		std::vector<bool> written;
+		const auto produce = [&written](AsyncQueue<Queue> &queue, const char *name) -> DetachedTask {
+			// not a temporary: GCC 12 frees aggregate temporaries of a `co_await` from the wrong address
+			Key key{ name };
+			written.push_back(co_await queue.async_write(std::move(key), Value{ 0 }));
+		};
+		check_true(full.try_write(Key{ "a" }, Value{ 0 }));
+		check_true(full.try_write(Key{ "b" }, Value{ 0 }));
+		produce(full, "c");
+		check_true(written.empty());
+		full.read();
+		check_true(written.size() == 1 && written.back());
+		check_true(full.size() == 2);
+		produce(full, "d");
+		full.stop();
+		check_true(written.size() == 2 && !written.back());
+	}
+	
+	std::vector<std::coroutine_handle<>> posted;
+	AsyncQueue<Queue> deferred{ 2 };
+	deferred.set_executor([&posted](std::coroutine_handle<> handle) { posted.push_back(handle); });
+	consume(deferred);
+	check_true(deferred.try_write(Key{ "2" }, Value{ 2 }));
+	check_true(posted.size() == 1 && delivered.size() == 1);
+	posted.back().resume();
+	posted.clear();
+	check_true(delivered.size() == 2 && delivered.back() == "2");
+	
+	// a suspended reader of a closed queue is resumed once the queue is empty
+	AsyncQueue<Queue> closing{ 2 };
+	bool closed = false;
+	const auto consume_until_closed = [&closed](AsyncQueue<Queue> &queue) -> DetachedTask {
+		try {
+			while (true) { co_await queue.async_read(); }
+		}
+		catch (const Utils::queue_closed_exception&) {
+			closed = true;
+		}
+	};
+	check_true(closing.try_write(Key{ "3" }, Value{ 3 }));
+	consume_until_closed(closing);
+	check_true(!closed && closing.size() == 0);
+	closing.close_writes();
+	check_true(closed);
+	
+	// consumers are resumed on the writer threads
+	constexpr size_t N_WRITERS = 4;
+	constexpr size_t N_WRITES = 1000;
+	AsyncQueue<Queue> shared{ 16 };
+	std::atomic<size_t> nDelivered = 0, nStopped = 0;
+	const auto count = [&nDelivered, &nStopped](AsyncQueue<Queue> &queue) -> DetachedTask {
+		try {
+			while (true) {
+				co_await queue.async_read();
+				nDelivered.fetch_add(1);
+			}
+		}
+		catch (const Utils::queue_stopped_exception&) {
+			nStopped.fetch_add(1);
+		}
+	};
+	for (size_t i = 0; i < 4; ++i) { count(shared); }
+	std::vector<std::thread> writers;
+	for (size_t w = 0; w < N_WRITERS; ++w) {
+		writers.emplace_back([&shared, w]() {
+			for (size_t i = 0; i < N_WRITES; ++i) {
+				while (!shared.try_write(Key{ std::to_string(w * N_WRITES + i) }, Value{ 0 })) {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+	for (std::thread &thrd : writers) { thrd.join(); }
+	shared.stop();
+	check_true(nDelivered.load() == N_WRITERS * N_WRITES);
+	check_true(nStopped.load() == 4);
+	
+	// operations that go around `try_write()` and `try_read()` complete waiters too
+	if constexpr (has_snapshot<Queue>::value) {
+		const std::string snapshotPath = std::filesystem::temp_directory_path() / "queue-test-async.snapshot";
+		AsyncQueue<Queue> source{ 2 };
+		check_true(source.try_write(Key{ "4" }, Value{ 4 }));
+		source.snapshot(snapshotPath);
+		AsyncQueue<Queue> restoring{ 2 };
+		consume(restoring);
+		check_true(restoring.restore(snapshotPath) == 1);
+		check_true(delivered.back() == "4" && restoring.size() == 0);
+		restoring.stop();
+		std::filesystem::remove(snapshotPath);
+	}
+	if constexpr (Queue::BOUNDED && has_sorted_read<Queue>::value) {
+		AsyncQueue<Queue> sorted{ 2 };
+		bool written = false;
+		const auto produce = [&written](AsyncQueue<Queue> &queue, const char *name) -> DetachedTask {
+			Key key{ name };
+			written = co_await queue.async_write(std::move(key), Value{ 0 });
+		};
+		check_true(sorted.try_write(Key{ "c" }, Value{ 0 }));
+		check_true(sorted.try_write(Key{ "d" }, Value{ 0 }));
+		produce(sorted, "e");
+		check_true(!written);
+		check_true(sorted.read_sorted_batch(1).size() == 1);
+		check_true(written);
+		written = false;
+		produce(sorted, "f");
+		check_true(!written);
+		check_true(sorted.read_range(Key{ "a" }, Key{ "z" }, 1).size() == 1);
+		check_true(written && sorted.size() == 2);
+		sorted.stop();
+	}
+	
+	queue.stop();
+	deferred.stop();
+	for (std::coroutine_handle<> handle : posted) { handle.resume(); }
+	check_true(stopped);
+}
+#endif
+
+/* Checks that the eventfd of a `PollableQueue` is signaled once per drained-to-non-empty
+ * transition and on `stop()`, and that 1 epoll thread can drain several queues. */
+template<typename Queue>
+static void test_pollable() {
+	using Key = typename Queue::key_type;
+	const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	const auto wait_ready = [epollFd](const int timeout) {
+		epoll_event event;
+		return epoll_wait(epollFd, &event, 1, timeout);
+	};
+	
+	{
+		PollableQueue<Queue> queue{ 4 };
+		epoll_event event{};
+		event.events = EPOLLIN | EPOLLET;
+		event.data.ptr = &queue;
+		check_true(epoll_ctl(epollFd, EPOLL_CTL_ADD, queue.fd(), &event) == 0);
+		check_true(wait_ready(0) == 0);
+		
+		check_true(queue.try_write(Key{ "1" }, Value{ 1 }));
+		check_true(queue.try_write(Key{ "2" }, Value{ 2 }));
+		check_true(queue.try_write(Key{ "2" }, Value{ 3 }));
+		check_true(wait_ready(0) == 1);
+		eventfd_t count = 0;
+		eventfd_read(queue.fd(), &count);
+		check_true(count == 1); // coalesced
+		const usize nQueued = queue.size(); // unbounded queues can keep a duplicate written to another shard
+		check_true(nQueued == 2 || (!Queue::BOUNDED && nQueued == 3));
+		check_true(queue.read_ready([](Key&&, Value&&) {}) == nQueued);
+		check_true(wait_ready(0) == 0);
+		
+		check_true(queue.try_write(Key{ "3" }, Value{ 4 }));
+		check_true(wait_ready(0) == 1);
+		check_true(queue.read_ready([](Key&&, Value&&) {}) == 1);
+		
+		if constexpr (has_snapshot<Queue>::value) {
+			const std::string snapshotPath = std::filesystem::temp_directory_path() / "queue-test-pollable.snapshot";
+			Queue source{ 4 };
+			check_true(source.try_write(Key{ "4" }, Value{ 5 }));
+			source.snapshot(snapshotPath);
+			check_true(queue.restore(snapshotPath) == 1);
+			check_true(wait_ready(0) == 1);
+			check_true(queue.read_ready([](Key&&, Value&&) {}) == 1);
+			std::filesystem::remove(snapshotPath);
+		}
+		queue.stop();
+		check_true(wait_ready(0) == 1);
+		check_true(queue.read_ready([](Key&&, Value&&) {}) == 0 && queue.stopped());
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, queue.fd(), nullptr);
+	}
+	
+	constexpr size_t N_QUEUES = 4;
+	constexpr size_t N_WRITES = 4096;
+	std::vector<std::unique_ptr<PollableQueue<Queue>>> queues;
+	std::vector<std::thread> writers;
+	for (size_t q = 0; q < N_QUEUES; ++q) {
+		queues.push_back(std::make_unique<PollableQueue<Queue>>(64));
+		epoll_event event{};
+		event.events = EPOLLIN | EPOLLET;
+		event.data.u64 = q;
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, queues.back()->fd(), &event);
+	}
+	for (size_t q = 0; q < N_QUEUES; ++q) {
+		writers.emplace_back([&queue = *queues[q]]() {
+			for (size_t i = 0; i < N_WRITES; ++i) {
+				while (!queue.try_write(Key{ std::to_string(i) }, Value{ 0 })) {
+					std::this_thread::yield();
+				}
+			}
+			queue.stop();
+		});
+	}
+	size_t nRead = 0, nStopped = 0;
+	std::array<bool, N_QUEUES> stopped{};
+	while (nStopped < N_QUEUES) {
+		std::array<epoll_event, N_QUEUES> events;
+		const int nEvents = epoll_wait(epollFd, events.data(), events.size(), 1000);
+		if (nEvents <= 0) { break; } // timed out, an item or a stop wasn't signaled
+		for (int e = 0; e < nEvents; ++e) {
+			const size_t q = events[e].data.u64;
+			nRead += queues[q]->read_ready([](Key&&, Value&&) {});
+			if (!stopped[q] && queues[q]->stopped() && queues[q]->size() == 0) {
+				stopped[q] = true;
+				++nStopped;
+			}
+		}
+	}
+	for (std::thread &thrd : writers) { thrd.join(); }
+	check_true(nStopped == N_QUEUES);
+	check_true(nRead == N_QUEUES * N_WRITES);
+	close(epollFd);
+}
+
+/* Checks the graceful shutdown: `close_writes()` rejects writes but keeps the items for readers,
+ * `drain()` waits for readers to empty the queue and `stop_now()` wakes every waiter up. */
+template<typename Queue>
+static void test_shutdown() {
+	using Key = typename Queue::key_type;
+	{
+		Queue queue{ 4 };
+		check_true(queue.try_write(Key{ "1" }, Value{ 1 }));
+		check_true(queue.try_write(Key{ "2" }, Value{ 2 }));
+		queue.close_writes();
+		check_true(queue.writes_closed() && !queue.stopped());
+		try {
+			queue.try_write(Key{ "3" }, Value{ 3 });
+			check_reachable_false();
+		}
+		catch (const Utils::queue_closed_exception&) {
+			check_reachable_true();
+		}
+		check_true(queue.size() == 2);
+		// "1" and "2" can be in different shards, so they can be read in either order
+		const int64_t first = queue.read().second._, second = queue.read().second._;
+		check_true(std::min(first, second) == 1 && std::max(first, second) == 2);
+		try {
+			queue.read();
+			check_reachable_false();
+		}
+		catch (const Utils::queue_closed_exception&) {
+			check_reachable_true();
+		}
+		check_true(queue.drain());
+	}
+	{
+		Queue queue{ 4 };
+		check_true(queue.try_write(Key{ "1" }, Value{ 1 }));
+		check_true(queue.try_write(Key{ "2" }, Value{ 2 }));
+		std::thread reader{ [&queue]() {
+			Utils::sleep(chrono::milliseconds{ 10 });
+			while (queue.try_read().has_value()) {}
+		} };
+		check_true(queue.drain());
+		check_true(queue.size() == 0);
+		reader.join();
+	}
+	{
+		Queue queue{ 4 };
+		check_true(queue.try_write(Key{ "1" }, Value{ 1 }));
+		std::thread stopper{ [&queue]() {
+			Utils::sleep(chrono::milliseconds{ 10 });
+			queue.stop_now();
+		} };
+		check_true(!queue.drain()); // nobody reads
+		stopper.join();
+		check_true(queue.read().second._ == 1); // still readable after a stop
+		
+		std::thread reader{ [&queue]() {
+			try {
+				queue.read();
+			}
+			catch (const Utils::queue_stopped_exception&) {}
+		} };
+		reader.join();
+		check_true(queue.stopped());
+	}
+	{
+		// writes racing with `close_writes()` either throw or are read, none are left behind
+		constexpr usize N_WRITERS = 4;
+		Queue queue{ 1024 };
+		std::atomic<usize> nWritten = 0, nRead = 0;
+		std::vector<std::thread> threads;
+		for (usize w = 0; w < N_WRITERS; ++w) {
+			threads.emplace_back([&queue, &nWritten, w]() {
+				try {
+					for (usize i = 0; ; ++i) {
+						nWritten += queue.try_write(Key{ std::to_string(w * 1000000 + i) }, Value{ 0 });
+					}
+				}
+				catch (const Utils::queue_closed_exception&) {}
+			});
+		}
+		threads.emplace_back([&queue, &nRead]() {
+			try {
+				while (true) {
+					queue.read();
+					++nRead;
+				}
+			}
+			catch (const Utils::queue_closed_exception&) {}
+		});
+		Utils::sleep(chrono::milliseconds{ 20 });
+		queue.close_writes();
+		for (std::thread &thrd : threads) { thrd.join(); }
+		check_true(nWritten.load() > 0);
+		check_true(nRead.load() == nWritten.load());
+		check_true(queue.size() == 0);
+	}
+}
+
+/* Checks the parsing of sysfs CPU lists, and that a reader pinned to a (simulated) node
+ * of a `Queue_NumaSharded` gets the items of its node's shards before the others. */
+static void test_numa() {
+	check_true(Utils::Numa::parse_cpulist("0-3,8,10-11\n") == std::vector<int>({ 0, 1, 2, 3, 8, 10, 11 }));
+	check_true(Utils::Numa::parse_cpulist("").empty());
+	
+	const Utils::Numa::Topology topology = Utils::Numa::Topology::simulate(2);
+	check_true(topology.node_count() == 2 && topology.simulated);
+	check_true(!topology.nodes[0].cpus.empty() && !topology.nodes[1].cpus.empty());
+	
+	Queue_NumaSharded<Key, Value> queue{ 64, 8, topology };
+	check_true(queue.shard_count() == 8 && queue.shard_node(5) == 1);
+	std::thread reader{ [&queue, &topology]() {
+		check_true(Utils::Numa::pin_thread(topology, 1));
+		check_true(Utils::Numa::current_node(topology) == 1);
+		usize nWritten = 0, nRead = 0;
+		for (int i = 0; i < 64; ++i) {
+			nWritten += queue.try_write(Key{ std::to_string(i) }, Value{ i });
+		}
+		check_true(nWritten == 64);
+		bool remoteSeen = false, localAfterRemote = false;
+		while (std::optional data = queue.try_read()) {
+			const bool local = (queue.node_of(data->first) == 1);
+			localAfterRemote |= (local && remoteSeen);
+			remoteSeen |= !local;
+			++nRead;
+		}
+		check_true(nRead == 64);
+		check_true(remoteSeen && !localAfterRemote);
+	} };
+	reader.join();
+}
+
+template<typename Queue, typename = void>
+struct has_fifo_index : std::false_type {};
+
+template<typename Queue>
+struct has_fifo_index<Queue, std::void_t<decltype(
+	std::declval<Queue&>().fifo_index(std::declval<const typename Queue::key_type&>())
+)>> : std::true_type {};
+
+/* Checks that `read_sorted_batch()` and `read_range()` return items in key order across
+ * shards, and that FIFO reads skip the items they removed. */
+template<typename Queue>
+static void test_sorted_read() {
+	using Key = typename Queue::key_type;
+	const auto keys_of = [](const std::vector<std::pair<Key, Value>> &batch) {
+		std::string keys;
+		for (const auto &[key, value] : batch) { keys += key_string(key); }
+		return keys;
+	};
+	
+	Queue queue{ 64 };
+	for (const char *key : { "e", "b", "d", "a", "c", "f", "b" }) {
+		check_true(queue.try_write(Key{ key }, Value{ key[0] }));
+	}
+	check_true(queue.size() == 6);
+	check_true(keys_of(queue.read_sorted_batch(2)) == "ab");
+	check_true(queue.size() == 4);
+	const auto range = queue.read_range(Key{ "c" }, Key{ "e" });
+	check_true(keys_of(range) == "cd" && range[0].second._ == 'c');
+	check_true(queue.size() == 2);
+	check_true(queue.read_range(Key{ "c" }, Key{ "e" }).empty());
+	check_true(queue.try_write(Key{ "c" }, Value{ 0 })); // a new item again
+	check_true(keys_of(queue.read_sorted_batch(10)) == "cef");
+	check_true(queue.size() == 0 && !queue.try_read().has_value());
+	
+	// FIFO reads skip the holes left by sorted reads, also once the FIFO has been compacted
+	for (int i = 0; i < 50; ++i) {
+		char key[8];
+		snprintf(key, sizeof (key), "%03d", i);
+		check_true(queue.try_write(Key{ key }, Value{ i }));
+	}
+	check_true(queue.read_range(Key{ "001" }, Key{ "049" }).size() == 48);
+	check_true(queue.try_write(Key{ "100" }, Value{ 100 }));
+	std::vector<std::string> left;
+	while (std::optional data = queue.try_read()) { left.push_back(key_string(data->first)); }
+	if constexpr (!has_fifo_index<Queue>::value) {
+		check_true(left == std::vector<std::string>({ "000", "049", "100" }));
+	}
+	std::sort(left.begin(), left.end());
+	check_true(left == std::vector<std::string>({ "000", "049", "100" }));
+	check_true(queue.size() == 0);
+}
+
+/* Checks that a `DurableQueue` recovers the items which weren't read, with their last value,
+ * across restarts, compaction of the log and a torn record at the end of the log.
+ */
+template<template<typename, typename> typename Queue>
+static void test_durability() {
+	const std::filesystem::path directory = std::filesystem::temp_directory_path() / "queue-test-wal";
+	std::filesystem::remove_all(directory);
+	DurabilityConfig config;
+	config.directory = directory;
+	config.segmentBytes = 4096;
+	config.compactSegments = 2;
+	config.waitForSync = false;
+	using Durable = DurableQueue<Queue, Key, Value>;
+	
+	constexpr size_t N_KEYS = 100;
+	std::map<std::string, int64_t> expected;
+	{
+		Durable queue{ config, 1024 };
+		for (int64_t i = 0; i < 2000; ++i) {
+			const std::string key = std::to_string(i % N_KEYS);
+			queue.try_write(Key{ key }, Value{ i });
+			expected[key] = i;
+			if (i % 200 == 199) { queue.sync(); } // each sync fills a segment, which starts a new one
+		}
+		for (size_t i = 0; i < N_KEYS / 2; ++i) { expected.erase(queue.read().first._); }
+		queue.sync();
+		
+		// the closed segments are compacted until fewer than `compactSegments` are left, next to the active one
+		size_t nSegments = 0;
+		for (size_t attempt = 0; attempt < 500; ++attempt) {
+			nSegments = std::distance(std::filesystem::directory_iterator{ directory }, std::filesystem::directory_iterator{});
+			if (nSegments <= config.compactSegments) { break; }
+			Utils::sleep(chrono::milliseconds{ 10 });
+		}
+		check_true(nSegments <= config.compactSegments);
+	}
+	
+	const auto check_recovered = [&](Durable &queue) {
+		check_true(queue.size() == expected.size());
+		std::map<std::string, int64_t> recovered;
+		while (recovered.size() < expected.size()) {
+			auto [key, value] = queue.read();
+			recovered.emplace(key._, value._);
+		}
+		check_true(recovered == expected);
+	};
+	{
+		config.waitForSync = true;
+		Durable queue{ config, 1024 };
+		check_recovered(queue);
+		
+		// concurrent writers that wait for their writes to be synced share the syncs
+		std::vector<std::thread> writers;
+		for (size_t w = 0; w < 8; ++w) {
+			writers.emplace_back([&queue, w]() {
+				for (int64_t i = 0; i < 50; ++i) { queue.try_write(Key{ "w" + std::to_string(w) }, Value{ i }); }
+			});
+		}
+		for (std::thread &thrd : writers) { thrd.join(); }
+	}
+	
+	expected.clear();
+	for (size_t w = 0; w < 8; ++w) { expected["w" + std::to_string(w)] = 49; }
+	std::filesystem::path lastSegment;
+	for (const auto &entry : std::filesystem::directory_iterator(directory)) {
+		lastSegment = std::max(lastSegment, entry.path());
+	}
+	if (FILE *file = fopen(lastSegment.c_str(), "ab")) {
+		fputs("torn record", file);
+		fclose(file);
+	}
+	{
+		Durable queue{ config, 1024 };
+		check_recovered(queue);
+	}
+	
+	// a write rejected over capacity isn't recovered
+	{
+		Durable queue{ config, 1 };
+		check_true(queue.try_write(Key{ "a" }, Value{ 1 }));
+		check_true(!queue.try_write(Key{ "b" }, Value{ 2 }));
+	}
+	expected = { { "a", 1 } };
+	{
+		Durable queue{ config, 1024 };
+		check_recovered(queue);
+	}
+	std::filesystem::remove_all(directory);
+}
+
+template<typename Queue, typename = void>
+struct has_reshard : std::false_type {};
+
+template<typename Queue>
+struct has_reshard<Queue, std::void_t<decltype(std::declval<Queue&>().reshard(usize{}))>> : std::true_type {};
+
+/* Which FIFO a key ends up in, queues without a `fifo_index()` have a single FIFO. */
+template<typename Queue>
+[[nodiscard]] static usize fifo_index_of(Queue &queue, const typename Queue::key_type &key) {
+	if constexpr (has_fifo_index<Queue>::value) { return queue.fifo_index(key); }
+	else { return 0; }
+}
+
+/* Multi-threaded stress test which logs the history of every thread and checks it afterwards.
+ * Every key is owned by a single writer which writes increasing values to it, so for each key:
+ * - every delivered value must have been written successfully (no phantom values),
+ * - a value must never be delivered twice (no duplicate deliveries of a pending key),
+ * - the last value that was written successfully must be delivered (no lost keys).
+ * The size of the queue is sampled while running to check that the capacity holds, and
+ * a second phase checks that keys written by a single writer are read in FIFO order.
+ * Queues that can reshard are resharded continuously while the writers run.
+ * Build with `make build SANITIZE=thread` or `SANITIZE=address` to run under a sanitizer.
+ */
+template<typename Queue>
+static void stress_test() {
+	using Key = typename Queue::key_type;
+	constexpr size_t N_WRITERS = 8;
+	constexpr size_t N_READERS = 8;
+	constexpr size_t N_KEYS_PER_WRITER = 64;
+	constexpr size_t N_WRITES = (1 << 14);
+	constexpr usize CAPACITY = N_WRITERS * N_KEYS_PER_WRITER / 4;
+	// sharded queues reserve capacity before checking it, which can overshoot while writing
+	constexpr usize CAPACITY_SLACK = N_WRITERS;
+	
+	struct Entry {
+		size_t key;
+		int64_t value;
+		bool success;
+	};
+	
+	Queue queue{ CAPACITY };
+	std::vector<std::vector<Entry>> writeLogs(N_WRITERS), readLogs(N_READERS);
+	std::vector<std::thread> writers, readers;
+	
+	for (size_t r = 0; r < N_READERS; ++r) {
+		readers.emplace_back([&queue, &log = readLogs[r]]() {
+			try {
+				while (true) {
+					auto [key, value] = queue.read();
+					log.push_back({ std::stoul(key_string(key)), value._, true });
+				}
+			}
+			catch (const Utils::queue_stopped_exception&) {}
+		});
+	}
+	
+	std::atomic<bool> writing = true;
+	std::atomic<usize> maxSize = 0;
+	std::thread monitor([&]() {
+		for (usize i = 0; writing.load(); ++i) {
+			const usize size = queue.size();
+			if (size > maxSize.load()) { maxSize.store(size); }
+			if constexpr (has_reshard<Queue>::value) {
+				queue.reshard(usize{ 1 } << (i % 6));
+			}
+			std::this_thread::yield();
+		}
+	});
+	
+	for (size_t w = 0; w < N_WRITERS; ++w) {
+		writers.emplace_back([&queue, &log = writeLogs[w], w]() {
+			std::mt19937 rng{ static_cast<uint32_t>(w) };
+			for (size_t i = 0; i < N_WRITES; ++i) {
+				const size_t key = w * N_KEYS_PER_WRITER + (rng() % N_KEYS_PER_WRITER);
+				const int64_t value = static_cast<int64_t>(i + 1);
+				const bool success = queue.try_write(Key{ std::to_string(key) }, Value{ value });
+				log.push_back({ key, value, success });
+			}
+		});
+	}
+	
+	for (std::thread &thrd : writers) { thrd.join(); }
+	writing.store(false);
+	monitor.join();
+	queue.stop(); // readers keep reading until the queue is empty
+	for (std::thread &thrd : readers) { thrd.join(); }
+	
+	std::unordered_map<size_t, std::vector<int64_t>> delivered;
+	for (const auto &log : readLogs) {
+		for (const Entry &entry : log) { delivered[entry.key].push_back(entry.value); }
+	}
+	
+	size_t nPhantom = 0, nDuplicate = 0, nLost = 0;
+	for (const auto &log : writeLogs) {
+		std::unordered_map<size_t, std::vector<int64_t>> written;
+		for (const Entry &entry : log) {
+			if (entry.success) { written[entry.key].push_back(entry.value); }
+		}
+		for (auto &[key, values] : written) {
+			std::vector<int64_t> &reads = delivered[key];
+			std::sort(reads.begin(), reads.end());
+			nDuplicate += (std::adjacent_find(reads.begin(), reads.end()) != reads.end());
+			for (const int64_t value : reads) {
+				nPhantom += !std::binary_search(values.begin(), values.end(), value);
+			}
+			nLost += !std::binary_search(reads.begin(), reads.end(), values.back());
+			delivered.erase(key);
+		}
+	}
+	nPhantom += delivered.size(); // keys that were never written successfully
+	
+	check_true(nPhantom == 0);
+	check_true(nDuplicate == 0);
+	check_true(nLost == 0);
+	check_true(!Queue::BOUNDED || maxSize.load() <= CAPACITY + CAPACITY_SLACK);
+	check_true(queue.size() == 0);
+	
+	// FIFO: a single writer inserts new keys while a single reader consumes them
+	Queue fifoQueue{ CAPACITY };
+	constexpr size_t N_FIFO_KEYS = 4 * CAPACITY;
+	std::vector<size_t> readOrder;
+	std::thread reader([&fifoQueue, &readOrder]() {
+		while (readOrder.size() < N_FIFO_KEYS) {
+			readOrder.push_back(std::stoul(key_string(fifoQueue.read().first)));
+		}
+	});
+	for (size_t key = 0; key < N_FIFO_KEYS; ++key) {
+		while (!fifoQueue.try_write(Key{ std::to_string(key) }, Value{ 0 })) {
+			std::this_thread::yield();
+		}
+	}
+	reader.join();
+	
+	std::unordered_map<usize, size_t> lastPerFifo;
+	size_t nReordered = 0;
+	for (const size_t key : readOrder) {
+		const usize index = fifo_index_of(fifoQueue, Key{ std::to_string(key) });
+		if (auto iter = lastPerFifo.find(index); iter != lastPerFifo.end() && iter->second > key) {
+			++nReordered;
+		}
+		lastPerFifo[index] = key;
+	}
+	check_true(nReordered == 0);
+}
+
+template<typename Queue, DataSet DATA_SET = DataSet::LINEAR_16BIT>
 static void blackbox_benchmark() {
-	constexpr DataSet DATA_SET =  DataSet::LINEAR_16BIT;
+	using Key = typename Queue::key_type;
 	constexpr size_t N_CYCLES = (1 << 16);
 	constexpr size_t N_THREADS = 128;
+	constexpr bool USE_PERF_COUNTERS = true;
 	Queue queue{ N_CYCLES };
 	
+	// opened before spawning threads so that the counters are inherited by them
+	std::optional<PerfCounters> perfCounters;
+	if (USE_PERF_COUNTERS) { perfCounters.emplace(); }
+	
 	std::array<std::thread, N_THREADS> writers;
 	std::array<std::thread, N_THREADS> readers;
 	
@@ -115,6 +932,7 @@ static void blackbox_benchmark() {
 	}
 	Utils::sleep(chrono::seconds{ 2 });
 	const chrono::time_point tpStart = chrono::system_clock::now();
+	if (perfCounters) { perfCounters->start(); }
 	waitFlag.store(false);
 	
 	
@@ -124,6 +942,7 @@ static void blackbox_benchmark() {
 	queue.stop();
 	for (std::thread &thrd : readers) { thrd.join(); }
 	const chrono::time_point tpEnd = chrono::system_clock::now();
+	if (perfCounters) { perfCounters->stop(); }
 	
 	printf("> Benchmark ran for \e[93m%'ld\e[mms with \e[93m%'u\e[m items left in queue.\n",
 		Utils::to_milli(tpEnd - tpStart).count(), queue.size()
@@ -137,6 +956,79 @@ static void blackbox_benchmark() {
 	printf("Waited \e[33m%'ld\e[mms on all threads.\n",
 		Utils::to_milli(tpEnd - tpWaitWriters).count()
 	);
+	if (perfCounters) { perfCounters->print(writers.size() * N_CYCLES); }
+}
+
+
+/* Pins a writer to each node in turn and compares the write throughput of the keys whose
+ * shard is on the writer's node with the others. On single-node machines, run it with
+ * `NUMA_SIMULATE_NODES=2` (both should be about the same there).
+ */
+template<typename Queue>
+static void numa_benchmark() {
+	using Key = typename Queue::key_type;
+	constexpr size_t N_KEYS = (1 << 18);
+	const Utils::Numa::Topology &topology = Utils::Numa::Topology::system();
+	printf("%zu%s NUMA nodes.\n", topology.node_count(), topology.simulated ? " simulated" : "");
+	
+	for (usize node = 0; node < topology.node_count(); ++node) {
+		Queue queue{ N_KEYS };
+		std::thread thrd{ [&queue, &topology, node]() {
+			Utils::Numa::pin_thread(topology, node);
+			std::array<std::vector<Key>, 2> keys; // local, remote
+			for (size_t i = 0; i < N_KEYS; ++i) {
+				Key key{ std::to_string(i) };
+				keys[queue.node_of(key) != node].push_back(std::move(key));
+			}
+			for (const bool remote : { false, true }) {
+				if (keys[remote].empty()) { continue; }
+				const auto tpStart = chrono::steady_clock::now();
+				for (Key &key : keys[remote]) { queue.try_write(std::move(key), Value{ 0 }); }
+				const auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - tpStart);
+				printf("Node %u: \e[33m%'.0f\e[m %s writes/s (%'zu keys).\n",
+					node, keys[remote].size() / elapsed.count(), remote ? "remote" : "local", keys[remote].size()
+				);
+			}
+			while (queue.try_read().has_value()) {}
+		} };
+		thrd.join();
+	}
+}
+
+/* Compares the probe loops of `Utils::FlatDedupQueue` on their own, single-threaded and
+ * without locks, with the group compare of each instruction set the CPU supports. */
+template<DataSet DATA_SET>
+static void probe_benchmark() {
+	namespace Flat = Impl::FlatDedupQueue;
+	constexpr size_t N_CYCLES = (1 << 22);
+	constexpr size_t N_ROUNDS = 8;
+	
+	DataSource<DATA_SET> src;
+	std::vector<std::pair<FixedKey, Value>> items;
+	items.reserve(N_CYCLES);
+	for (size_t i = 0; i < N_CYCLES; ++i) {
+		auto [id, number] = src.get();
+		items.emplace_back(FixedKey{ id }, Value{ number });
+	}
+	
+	std::vector<Flat::Isa> isas{ Flat::Isa::SCALAR };
+#if defined(__SSE2__)
+	isas.push_back(Flat::Isa::SSE2);
+	if (Flat::isa_for_cpu() == Flat::Isa::AVX2) { isas.push_back(Flat::Isa::AVX2); }
+#endif
+	for (const Flat::Isa isa : isas) {
+		double best = std::numeric_limits<double>::max();
+		for (size_t round = 0; round < N_ROUNDS; ++round) {
+			Utils::FlatDedupQueue<FixedKey, Value> queue{ 16, isa };
+			const auto tpStart = chrono::steady_clock::now();
+			for (size_t i = 0; i < items.size(); ++i) {
+				queue.insert_or_assign(items[i].first, items[i].second);
+				if (i % 2 == 1 && !queue.empty()) { (void)queue.pop(); }
+			}
+			best = std::min(best, chrono::duration<double, std::nano>(chrono::steady_clock::now() - tpStart).count());
+		}
+		printf("%-6s \e[93m%.2f\e[mns per write (best of %zu).\n", Flat::isa_name(isa), best / N_CYCLES, N_ROUNDS);
+	}
 }
 
 
@@ -147,6 +1039,62 @@ static void blackbox_benchmark() {
 	puts("\n"); \
 } while (0)
 
+#define RUN_DURABILITY_TEST(...) do { \
+	puts("================================================================================"); \
+	puts(">>> Running test_durability with type: \e[33m" STRINGIFY(__VA_ARGS__) "\e[m"); \
+	test_durability<__VA_ARGS__>(); \
+	puts("\n"); \
+} while (0)
+
+#define RUN_ASYNC_TEST(...) do { \
+	puts("================================================================================"); \
+	puts(">>> Running test_async with type: \e[33m" STRINGIFY(__VA_ARGS__) "\e[m"); \
+	test_async<__VA_ARGS__>(); \
+	puts("\n"); \
+} while (0)
+
+#define RUN_POLLABLE_TEST(...) do { \
+	puts("================================================================================"); \
+	puts(">>> Running test_pollable with type: \e[33m" STRINGIFY(__VA_ARGS__) "\e[m"); \
+	test_pollable<__VA_ARGS__>(); \
+	puts("\n"); \
+} while (0)
+
+#define RUN_SHUTDOWN_TEST(...) do { \
+	puts("================================================================================"); \
+	puts(">>> Running test_shutdown with type: \e[33m" STRINGIFY(__VA_ARGS__) "\e[m"); \
+	test_shutdown<__VA_ARGS__>(); \
+	puts("\n"); \
+} while (0)
+
+#define RUN_NUMA_BENCHMARK(...) do { \
+	puts("================================================================================"); \
+	puts(">>> Running numa_benchmark with type: \e[33m" STRINGIFY(__VA_ARGS__) "\e[m"); \
+	numa_benchmark<__VA_ARGS__>(); \
+	puts("\n"); \
+} while (0)
+
+#define RUN_SORTED_READ_TEST(...) do { \
+	puts("================================================================================"); \
+	puts(">>> Running test_sorted_read with type: \e[33m" STRINGIFY(__VA_ARGS__) "\e[m"); \
+	test_sorted_read<__VA_ARGS__>(); \
+	puts("\n"); \
+} while (0)
+
+#define RUN_STRESS_TEST(...) do { \
+	puts("================================================================================"); \
+	puts(">>> Running stress_test with type: \e[33m" STRINGIFY(__VA_ARGS__) "\e[m"); \
+	stress_test<__VA_ARGS__>(); \
+	puts("\n"); \
+} while (0)
+
+#define RUN_PROBE_BENCHMARK(...) do { \
+	puts("================================================================================"); \
+	puts(">>> Running probe_benchmark with data set: \e[33m" STRINGIFY(__VA_ARGS__) "\e[m"); \
+	probe_benchmark<__VA_ARGS__>(); \
+	puts("\n"); \
+} while (0)
+
 #define RUN_BLACKBOX_BENCHMARK(...) do { \
 	puts("================================================================================"); \
 	puts(">>> Running blackbox_benchmark with type: \e[33m" STRINGIFY(__VA_ARGS__) "\e[m"); \
@@ -154,17 +1102,110 @@ static void blackbox_benchmark() {
 	puts("\n"); \
 } while (0)
 
-int main() {
+/* Usage: `queue-test [test] [stress] [benchmark]`, runs every section when none are given. */
+int main(int argc, char **argv) {
 	setlocale(LC_NUMERIC, ""); // to add commas in printf
-	RUN_TEST(Queue_1Lock<Key, Value>);
-	RUN_TEST(Queue_1LockSharded<Key, Value, 16>);
-	RUN_TEST(Queue_2Lock<Key, Value>);
-	RUN_TEST(Queue_2LockSharded<Key, Value, 16>);
-	RUN_TEST(Queue_SplitSharded<Key, Value, 16>);
-	RUN_BLACKBOX_BENCHMARK(Queue_1Lock<Key, Value>);
-	RUN_BLACKBOX_BENCHMARK(Queue_1LockSharded<Key, Value, 16>);
-	RUN_BLACKBOX_BENCHMARK(Queue_2Lock<Key, Value>);
-	RUN_BLACKBOX_BENCHMARK(Queue_2LockSharded<Key, Value, 16>);
-	RUN_BLACKBOX_BENCHMARK(Queue_SplitSharded<Key, Value, 16>);
+	const auto section_enabled = [argc, argv](const std::string_view section) {
+		return argc <= 1 || std::find(argv + 1, argv + argc, section) != argv + argc;
+	};
+	
+	if (section_enabled("test")) {
+		RUN_TEST(Queue_1Lock<Key, Value>);
+		RUN_TEST(Queue_1Lock<FixedKey, Value>);
+		RUN_TEST(Queue_1LockSharded<Key, Value>);
+		RUN_TEST(Queue_1LockSharded<FixedKey, Value>);
+		RUN_TEST(Queue_1LockShardedUnlimited<Key, Value>);
+		RUN_TEST(Queue_2Lock<Key, Value>);
+		RUN_TEST(Queue_2LockSharded<Key, Value>);
+		RUN_TEST(Queue_SplitSharded<Key, Value>);
+		RUN_TEST(Queue_AdaptiveSharded<Key, Value>);
+		RUN_TEST(Queue_NumaSharded<Key, Value>);
+		RUN_SORTED_READ_TEST(Queue_1Lock<Key, Value>);
+		RUN_SORTED_READ_TEST(Queue_1LockSharded<Key, Value>);
+		RUN_SORTED_READ_TEST(Configured<Queue_1LockSharded<Key, Value>, 4>);
+		puts("================================================================================");
+		puts(">>> Running test_match_group");
+		test_match_group();
+		puts("\n");
+		puts("================================================================================");
+		puts(">>> Running test_flat_sequential_keys");
+		test_flat_sequential_keys();
+		puts("\n");
+		puts("================================================================================");
+		puts(">>> Running test_numa");
+		test_numa();
+		puts("\n");
+		RUN_SHUTDOWN_TEST(Queue_1Lock<Key, Value>);
+		RUN_SHUTDOWN_TEST(Queue_1Lock<FixedKey, Value>);
+		RUN_SHUTDOWN_TEST(Queue_1LockSharded<Key, Value>);
+		RUN_SHUTDOWN_TEST(Queue_1LockSharded<FixedKey, Value>);
+		RUN_SHUTDOWN_TEST(Queue_1LockShardedUnlimited<Key, Value>);
+		RUN_SHUTDOWN_TEST(Queue_2Lock<Key, Value>);
+		RUN_SHUTDOWN_TEST(Queue_2LockSharded<Key, Value>);
+		RUN_SHUTDOWN_TEST(Queue_2LockShardedUnlimited<Key, Value>);
+		RUN_SHUTDOWN_TEST(Queue_SplitSharded<Key, Value>);
+		RUN_SHUTDOWN_TEST(Queue_AdaptiveSharded<Key, Value>);
+		RUN_SHUTDOWN_TEST(Queue_NumaSharded<Key, Value>);
+		RUN_POLLABLE_TEST(Queue_1Lock<Key, Value>);
+		RUN_POLLABLE_TEST(Queue_1LockSharded<FixedKey, Value>);
+		RUN_POLLABLE_TEST(Queue_2LockSharded<Key, Value>);
+		RUN_POLLABLE_TEST(Configured<Queue_2LockShardedUnlimited<Key, Value>, 4>);
+		RUN_POLLABLE_TEST(Queue_SplitSharded<Key, Value>);
+#if __cplusplus >= 202002L
+		RUN_ASYNC_TEST(Queue_1Lock<Key, Value>);
+		RUN_ASYNC_TEST(Queue_1LockSharded<FixedKey, Value>);
+		RUN_ASYNC_TEST(Queue_1LockShardedUnlimited<Key, Value>);
+		RUN_ASYNC_TEST(Queue_2LockSharded<Key, Value>);
+		RUN_ASYNC_TEST(Configured<Queue_2LockShardedUnlimited<Key, Value>, 4>);
+		RUN_ASYNC_TEST(Queue_SplitSharded<Key, Value>);
+		RUN_ASYNC_TEST(Queue_AdaptiveSharded<Key, Value>);
+#endif
+		RUN_DURABILITY_TEST(Queue_1Lock);
+		RUN_DURABILITY_TEST(Queue_2LockSharded);
+	}
+	if (section_enabled("stress")) {
+		RUN_STRESS_TEST(Queue_1Lock<Key, Value>);
+		RUN_STRESS_TEST(Queue_1Lock<FixedKey, Value>);
+		RUN_STRESS_TEST(Queue_1LockSharded<Key, Value>);
+		RUN_STRESS_TEST(Queue_1LockSharded<FixedKey, Value>);
+		RUN_STRESS_TEST(Configured<Queue_1LockSharded<Key, Value>, 16>);
+		RUN_STRESS_TEST(Configured<Queue_1LockShardedUnlimited<Key, Value>, 16>);
+		RUN_STRESS_TEST(Queue_2Lock<Key, Value>);
+		RUN_STRESS_TEST(Queue_2LockSharded<Key, Value>);
+		RUN_STRESS_TEST(Configured<Queue_2LockSharded<Key, Value>, 16>);
+		RUN_STRESS_TEST(Queue_SplitSharded<Key, Value>);
+		RUN_STRESS_TEST(Configured<Queue_SplitSharded<Key, Value>, 16>);
+		RUN_STRESS_TEST(Configured<Queue_SplitSharded<Key, Value>, 4, 16>);
+		RUN_STRESS_TEST(Configured<Queue_AdaptiveSharded<Key, Value>, 4, 1, 32>);
+		RUN_STRESS_TEST(Queue_NumaSharded<Key, Value>);
+		RUN_STRESS_TEST(Configured<Queue_NumaSharded<Key, Value>, 16>);
+	}
+	if (section_enabled("benchmark")) {
+		RUN_BLACKBOX_BENCHMARK(Queue_1Lock<Key, Value>);
+		RUN_BLACKBOX_BENCHMARK(Queue_1Lock<FixedKey, Value>);
+		RUN_BLACKBOX_BENCHMARK(Queue_1LockSharded<Key, Value>);
+		RUN_BLACKBOX_BENCHMARK(Queue_1LockSharded<FixedKey, Value>);
+		RUN_BLACKBOX_BENCHMARK(Configured<Queue_1LockSharded<Key, Value>, 16>);
+		RUN_BLACKBOX_BENCHMARK(Queue_1LockShardedUnlimited<Key, Value>);
+		RUN_BLACKBOX_BENCHMARK(Queue_2Lock<Key, Value>);
+		RUN_BLACKBOX_BENCHMARK(Queue_2LockSharded<Key, Value>);
+		RUN_BLACKBOX_BENCHMARK(Queue_SplitSharded<Key, Value>);
+		// 64 maps funneling into 4 queues (the previous fixed layout) versus a queue per map
+		RUN_BLACKBOX_BENCHMARK(Configured<Queue_SplitSharded<Key, Value>, 64, 4>);
+		RUN_BLACKBOX_BENCHMARK(Configured<Queue_SplitSharded<Key, Value>, 64, 64>);
+		RUN_BLACKBOX_BENCHMARK(Queue_AdaptiveSharded<Key, Value>);
+		// dedup probes in `std::map` versus the inline table, with mostly and only duplicates
+		RUN_BLACKBOX_BENCHMARK(Queue_1LockSharded<Key, Value>, DataSet::LINEAR_8BIT);
+		RUN_BLACKBOX_BENCHMARK(Queue_1LockSharded<FixedKey, Value>, DataSet::LINEAR_8BIT);
+		RUN_BLACKBOX_BENCHMARK(Queue_1LockSharded<Key, Value>, DataSet::ZEROES);
+		RUN_BLACKBOX_BENCHMARK(Queue_1LockSharded<FixedKey, Value>, DataSet::ZEROES);
+		RUN_PROBE_BENCHMARK(DataSet::LINEAR_8BIT);
+		RUN_PROBE_BENCHMARK(DataSet::ZEROES);
+		// dedup hits of `Queue_2LockSharded` only take the map lock shared
+		RUN_BLACKBOX_BENCHMARK(Queue_2LockSharded<Key, Value>, DataSet::LINEAR_8BIT);
+		RUN_BLACKBOX_BENCHMARK(Queue_2LockSharded<Key, Value>, DataSet::ZEROES);
+		RUN_BLACKBOX_BENCHMARK(Queue_NumaSharded<Key, Value>);
+		RUN_NUMA_BENCHMARK(Configured<Queue_NumaSharded<Key, Value>, 16>);
+	}
 	return 0;
 }
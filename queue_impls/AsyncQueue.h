@@ -0,0 +1,327 @@
+#pragma once
+#include "BaseQueue.h"
+
+#if __cplusplus >= 202002L
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+
+/* Adds `co_await queue.async_read()` and `co_await queue.async_write(key, value)` to any
+ * implementation. An awaiter that can't complete right away registers itself and suspends
+ * without holding a thread; the writer (or reader) whose operation lets it complete does
+ * its read (or write) on its behalf and resumes it, inline or through `set_executor()`.
+ * Needs C++20, build with `make build CXX_STD=c++20`.
+ *
+ * A waiter registers itself before retrying its operation, and the other side completes
+ * its operation before checking for waiters, with a full fence in between on both sides,
+ * so at least one of them sees the other and no wakeup is lost.
+ */
+template<typename Queue>
+class AsyncQueue : public Queue
+{
+public:
+	using Key = typename Queue::key_type;
+	using Value = typename Queue::value_type;
+	using KVPair = std::pair<Key, Value>;
+	/* Resumes a coroutine, e.g by posting it to an executor. */
+	using Executor = std::function<void(std::coroutine_handle<>)>;
+	
+	class ReadAwaiter
+	{
+	private:
+		friend AsyncQueue;
+		
+		AsyncQueue &m_queue;
+		std::optional<KVPair> m_data;
+		std::coroutine_handle<> m_handle;
+	public:
+		ReadAwaiter(AsyncQueue &queue) : m_queue{ queue } {}
+		
+		bool await_ready() { return (m_data = m_queue.try_read()).has_value(); }
+		bool await_suspend(std::coroutine_handle<> handle) {
+			m_handle = handle;
+			return m_queue._suspend(*this);
+		}
+		
+		/* Throws `Utils::queue_stopped_exception` when the queue is stopped and empty,
+		 * or `Utils::queue_closed_exception` when it's closed for writes and empty. */
+		KVPair await_resume() {
+			if (!m_data.has_value()) {
+				if (m_queue.writes_closed() && !m_queue.stopped()) {
+					throw Utils::queue_closed_exception{};
+				}
+				throw Utils::queue_stopped_exception{};
+			}
+			return std::move(*m_data);
+		}
+	};
+	
+	class WriteAwaiter
+	{
+	private:
+		friend AsyncQueue;
+		
+		AsyncQueue &m_queue;
+		Key m_key;
+		Value m_value;
+		bool m_written = false;
+		std::coroutine_handle<> m_handle;
+		
+		// copies so that the arguments survive a failed attempt
+		bool _try_write() {
+			try {
+				return m_queue.Queue::try_write(Key{ m_key }, Value{ m_value });
+			}
+			catch (const Utils::queue_closed_exception&) {
+				return false; // thrown by `await_resume()` once the waiter is cancelled
+			}
+		}
+	public:
+		WriteAwaiter(AsyncQueue &queue, Key &&key, Value &&value)
+			: m_queue{ queue }, m_key{ std::move(key) }, m_value{ std::move(value) }
+		{}
+		
+		bool await_ready() {
+			if ((m_written = _try_write())) { m_queue._pump(); }
+			return m_written;
+		}
+		bool await_suspend(std::coroutine_handle<> handle) {
+			m_handle = handle;
+			return m_queue._suspend(*this);
+		}
+		
+		/* Returns `false` when the queue was stopped before the item could be written,
+		 * throws `Utils::queue_closed_exception` when it was closed for writes. */
+		bool await_resume() {
+			if (!m_written && m_queue.writes_closed()) {
+				throw Utils::queue_closed_exception{};
+			}
+			return m_written;
+		}
+	};
+private:
+	std::mutex m_waitLock;
+	std::deque<ReadAwaiter*> m_readers;
+	std::deque<WriteAwaiter*> m_writers;
+	std::atomic<usize> m_nWaiting;
+	Executor m_executor;
+	
+	void _resume(const std::vector<std::coroutine_handle<>> &handles) {
+		for (const std::coroutine_handle<> handle : handles) {
+			if (m_executor) { m_executor(handle); }
+			else { handle.resume(); }
+		}
+	}
+	
+	/* Completes the operations of waiters until neither readers nor writers can progress.
+	 * `m_waitLock` must be held, the returned waiters must be resumed after releasing it. */
+	[[nodiscard]] std::vector<std::coroutine_handle<>> _locked_complete_waiters() {
+		std::vector<std::coroutine_handle<>> completed;
+		for (bool progress = true; progress; ) {
+			progress = false;
+			while (!m_writers.empty() && m_writers.front()->_try_write()) {
+				m_writers.front()->m_written = true;
+				completed.push_back(m_writers.front()->m_handle);
+				m_writers.pop_front();
+				progress = true;
+			}
+			while (!m_readers.empty()) {
+				std::optional data = Queue::try_read();
+				if (!data.has_value()) { break; }
+				m_readers.front()->m_data = std::move(data);
+				completed.push_back(m_readers.front()->m_handle);
+				m_readers.pop_front();
+				progress = true;
+			}
+		}
+		m_nWaiting.store(m_readers.size() + m_writers.size(), std::memory_order_relaxed);
+		return completed;
+	}
+	
+	/* Orders a waiter's registration before its retry. TSan doesn't support fences,
+	 * there the read-modify-writes on `m_nWaiting` order both sides instead. */
+	static void _fence() {
+#if !defined(__SANITIZE_THREAD__)
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+	}
+	
+	/* Orders the caller's operation before the check for waiters. */
+	[[nodiscard]] usize _load_waiting() {
+#if defined(__SANITIZE_THREAD__)
+		return m_nWaiting.fetch_add(0, std::memory_order_acq_rel);
+#else
+		_fence();
+		return m_nWaiting.load(std::memory_order_relaxed);
+#endif
+	}
+	
+	/* Called after every operation that may let a waiter complete. */
+	void _pump() {
+		if (_load_waiting() == 0) { return; }
+		
+		std::vector<std::coroutine_handle<>> completed;
+		{
+			DECL_LOCK_GUARD(m_waitLock);
+			completed = _locked_complete_waiters();
+			_locked_cancel_stuck_waiters(completed);
+		}
+		_resume(completed);
+	}
+	
+	/* Registers `awaiter` and retries, returns whether it stays suspended. */
+	template<typename Awaiter>
+	bool _suspend(Awaiter &awaiter) {
+		// once registered, another thread can resume the coroutine (and destroy the awaiter)
+		// as soon as `m_waitLock` is released
+		const std::coroutine_handle<> handle = awaiter.m_handle;
+		std::vector<std::coroutine_handle<>> completed;
+		{
+			DECL_LOCK_GUARD(m_waitLock);
+			if constexpr (std::is_same_v<Awaiter, ReadAwaiter>) { m_readers.push_back(&awaiter); }
+			else { m_writers.push_back(&awaiter); }
+			m_nWaiting.fetch_add(1, std::memory_order_acq_rel);
+			_fence();
+			
+			completed = _locked_complete_waiters();
+			_locked_cancel_stuck_waiters(completed);
+		}
+		
+		const auto self = std::find(completed.begin(), completed.end(), handle);
+		const bool suspended = (self == completed.end());
+		if (!suspended) { completed.erase(self); }
+		_resume(completed);
+		return suspended;
+	}
+	
+	/* Completes every waiter without an item. `m_waitLock` must be held. */
+	void _locked_cancel_waiters(std::vector<std::coroutine_handle<>> &completed) {
+		for (ReadAwaiter *reader : m_readers) { completed.push_back(reader->m_handle); }
+		for (WriteAwaiter *writer : m_writers) { completed.push_back(writer->m_handle); }
+		m_readers.clear();
+		m_writers.clear();
+		m_nWaiting.store(0, std::memory_order_relaxed);
+	}
+	
+	/* Completes the waiters which can't progress anymore: every waiter once the queue is
+	 * stopped, writers once it's closed, and readers once it's also empty (writes that are
+	 * in progress are counted by `size()` and complete readers when they're done).
+	 * `m_waitLock` must be held. */
+	void _locked_cancel_stuck_waiters(std::vector<std::coroutine_handle<>> &completed) {
+		if (this->stopped()) {
+			_locked_cancel_waiters(completed);
+			return;
+		}
+		if (!this->writes_closed()) { return; }
+		
+		for (WriteAwaiter *writer : m_writers) { completed.push_back(writer->m_handle); }
+		m_writers.clear();
+		if (Queue::size() == 0) {
+			for (ReadAwaiter *reader : m_readers) { completed.push_back(reader->m_handle); }
+			m_readers.clear();
+		}
+		m_nWaiting.store(m_readers.size(), std::memory_order_relaxed);
+	}
+public:
+	template<typename ...ARGS>
+	AsyncQueue(ARGS &&...args)
+		: Queue(std::forward<ARGS>(args)...)
+		, m_nWaiting{ 0 }
+	{}
+	
+	/* By default waiters are resumed inline by the thread whose operation completed theirs.
+	 * Must be set before any coroutine waits. */
+	void set_executor(Executor executor) { m_executor = std::move(executor); }
+	
+	[[nodiscard]] ReadAwaiter async_read() { return ReadAwaiter{ *this }; }
+	[[nodiscard]] WriteAwaiter async_write(Key &&key, Value &&value) {
+		return WriteAwaiter{ *this, std::move(key), std::move(value) };
+	}
+	
+	/* Suspended readers get the items that are left, then every waiter is resumed:
+	 * readers with `Utils::queue_stopped_exception` and writers with `false`. */
+	void stop() {
+		Queue::stop(); // waiters check it under `m_waitLock`
+		
+		std::vector<std::coroutine_handle<>> completed;
+		{
+			DECL_LOCK_GUARD(m_waitLock);
+			completed = _locked_complete_waiters();
+			_locked_cancel_waiters(completed);
+		}
+		_resume(completed);
+	}
+	
+	void stop_now() {
+		Queue::stop_now();
+		stop();
+	}
+	
+	/* Suspended writers are resumed with `Utils::queue_closed_exception`, and suspended
+	 * readers too once the items that are left have been read. */
+	void close_writes() {
+		Queue::close_writes(); // waiters check it under `m_waitLock`
+		
+		std::vector<std::coroutine_handle<>> completed;
+		{
+			DECL_LOCK_GUARD(m_waitLock);
+			completed = _locked_complete_waiters();
+			_locked_cancel_stuck_waiters(completed);
+		}
+		_resume(completed);
+	}
+	
+	bool try_write(Key &&key, Value &&value) {
+		const bool written = Queue::try_write(std::move(key), std::move(value));
+		if (written) { _pump(); }
+		return written;
+	}
+	
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		std::optional data = Queue::try_read();
+		if (data.has_value()) { _pump(); }
+		return data;
+	}
+	
+	/* Writes the items of the snapshot at `path`, then completes the waiting readers. */
+	usize restore(const std::string &path) {
+		const usize nRestored = Queue::restore(path);
+		_pump();
+		return nRestored;
+	}
+	
+	/* Key-ordered reads of the queues that have them, then completes the waiting writers. */
+	[[nodiscard]] std::vector<KVPair> read_sorted_batch(const usize maxItems) {
+		std::vector<KVPair> items = Queue::read_sorted_batch(maxItems);
+		if (!items.empty()) { _pump(); }
+		return items;
+	}
+	
+	[[nodiscard]] std::vector<KVPair> read_range(const Key &first, const Key &last, const usize maxItems = ~usize{ 0 }) {
+		std::vector<KVPair> items = Queue::read_range(first, last, maxItems);
+		if (!items.empty()) { _pump(); }
+		return items;
+	}
+	
+	KVPair read() {
+		while (true) {
+			if (std::optional data = try_read()) {
+				return *data;
+			}
+			
+			if (this->stopped()) {
+				throw Utils::queue_stopped_exception{};
+			}
+			if (this->writes_closed() && this->size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
+		}
+	}
+};
+
+#endif
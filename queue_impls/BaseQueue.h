@@ -1,6 +1,8 @@
 #pragma once
+#include "Snapshot.h"
 #include "utils.h"
 #include <atomic>
+#include <condition_variable>
 
 
 constexpr auto WAIT_TIME = chrono::milliseconds{ 1 };
@@ -17,15 +19,37 @@ private:
 	static_assert(std::is_same_v<Value, Utils::remove_cvref_t<Value>>);
 	
 	const uint32_t m_capacity;
-	std::atomic<bool> m_stop;
+	std::atomic<bool> m_stop, m_closed, m_stopNow;
+	std::mutex m_waitLock;
+	std::condition_variable m_waitCondition;
+protected:
+	/* Sleeps between 2 attempts of a reader, until `WAIT_TIME` has passed or
+	 * `stop_now()` (or `close_writes()`) is called. */
+	void _wait() {
+		std::unique_lock<std::mutex> uniqueLock{ m_waitLock };
+		if (!m_stopNow.load()) { m_waitCondition.wait_for(uniqueLock, WAIT_TIME); }
+	}
+	
+	/* Implements `drain()` with the `size()` of the implementation. */
+	template<typename SizeFn>
+	bool _drain(SizeFn &&size) {
+		while (size() > 0) {
+			if (m_stopNow.load()) { return false; }
+			_wait();
+		}
+		return true;
+	}
 public:
 	using KVPair = std::pair<Key, Value>;
 	using key_type = Key;
 	using value_type = Value;
 	
+	// whether `try_write()` fails for new keys once `capacity()` items are queued
+	constexpr static bool BOUNDED = true;
+	
 	
 	BaseQueue(const usize capacity)
-		: m_capacity{ capacity }, m_stop{ false }
+		: m_capacity{ capacity }, m_stop{ false }, m_closed{ false }, m_stopNow{ false }
 	{ printf("Creating queue with capacity of %'u.\n", m_capacity); }
 	
 	~BaseQueue() { this->stop(); }
@@ -34,6 +58,26 @@ public:
 		if (!m_stop.exchange(true)) { printf("Stopping queue...\n"); }
 	}
 	
+	/* Makes `try_write()` throw `Utils::queue_closed_exception` from now on, readers get the
+	 * items that are left and then throw it too. Writes that are in progress either complete
+	 * before the queue looks empty to readers or throw, so no item is left behind. */
+	void close_writes() {
+		if (!m_closed.exchange(true)) { printf("Closing queue for writes...\n"); }
+		m_waitCondition.notify_all(); // so that readers of an empty queue notice it now
+	}
+	
+	/* Stops the queue and wakes every waiting reader and `drain()` up right away.
+	 * Readers still get the items that are left before they throw. */
+	void stop_now() {
+		this->stop();
+		{
+			DECL_LOCK_GUARD(m_waitLock);
+			m_stopNow.store(true);
+		}
+		m_waitCondition.notify_all();
+	}
+	
 	[[nodiscard]] constexpr bool stopped() const { return m_stop.load(); }
+	[[nodiscard]] bool writes_closed() const { return m_closed.load(); }
 	[[nodiscard]] constexpr usize capacity() const { return m_capacity; }
 };
@@ -0,0 +1,570 @@
+#pragma once
+#include "BaseQueue.h"
+#include <condition_variable>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+
+struct DurabilityConfig
+{
+	std::string directory;
+	// longest time an appended record waits before it's written and synced with `fdatasync()`
+	chrono::milliseconds syncInterval{ 2 };
+	// sync earlier once this many bytes are waiting
+	size_t flushBytes = 1 << 20;
+	// a new segment is started once the current one is larger than this
+	size_t segmentBytes = 64 << 20;
+	// closed segments are compacted into a checkpoint once there are this many
+	size_t compactSegments = 4;
+	// whether `try_write()` returns only after its record has been synced
+	bool waitForSync = true;
+};
+
+namespace Impl::DurableQueue
+{
+
+enum class RecordType : uint8_t {
+	WRITE = 1, // key was written with a value
+	CONSUME = 2, // the write with the same LSN was read
+};
+
+/* Pending writes by serialized key. */
+struct PendingWrite {
+	uint64_t lsn;
+	std::string value;
+};
+using PendingMap = std::unordered_map<std::string, PendingWrite>;
+
+[[nodiscard]] constexpr
+uint32_t checksum(const std::string_view data) {
+	uint32_t hash = 2166136261u; // FNV-1a
+	for (const char c : data) { hash = (hash ^ uint8_t(c)) * 16777619u; }
+	return hash;
+}
+
+/* record: uint32_t nBytes, uint32_t checksum, then nBytes of:
+ *         uint8_t type, uint64_t lsn, uint32_t keySize, key, value (rest of the record) */
+[[nodiscard]] inline
+std::string encode(const RecordType type, const uint64_t lsn, const std::string_view key, const std::string_view value) {
+	std::string body;
+	Utils::Serializer<uint8_t>::write(body, static_cast<uint8_t>(type));
+	Utils::Serializer<uint64_t>::write(body, lsn);
+	Utils::Serializer<uint32_t>::write(body, static_cast<uint32_t>(key.size()));
+	body.append(key).append(value);
+	
+	std::string record;
+	Utils::Serializer<uint32_t>::write(record, static_cast<uint32_t>(body.size()));
+	Utils::Serializer<uint32_t>::write(record, checksum(body));
+	return record.append(body);
+}
+
+/* Applies `record` to `pending`, returns `false` when the record is torn or corrupted. */
+[[nodiscard]] inline
+bool apply(PendingMap &pending, const char *&pos, const char *end) {
+	const char *cursor = pos;
+	uint32_t size, sum, keySize;
+	uint8_t type;
+	uint64_t lsn;
+	if (!Utils::Serializer<uint32_t>::read(cursor, end, size)
+		|| !Utils::Serializer<uint32_t>::read(cursor, end, sum)
+		|| size_t(end - cursor) < size
+		|| checksum(std::string_view(cursor, size)) != sum)
+	{
+		return false;
+	}
+	const char *const recordEnd = cursor + size;
+	if (!Utils::Serializer<uint8_t>::read(cursor, recordEnd, type)
+		|| !Utils::Serializer<uint64_t>::read(cursor, recordEnd, lsn)
+		|| !Utils::Serializer<uint32_t>::read(cursor, recordEnd, keySize)
+		|| size_t(recordEnd - cursor) < keySize)
+	{
+		return false;
+	}
+	
+	std::string key(cursor, keySize);
+	cursor += keySize;
+	switch (static_cast<RecordType>(type))
+	{
+	case RecordType::WRITE:
+		pending[std::move(key)] = PendingWrite{ lsn, std::string(cursor, recordEnd) };
+		break;
+	case RecordType::CONSUME:
+		// a newer write of the key stays pending, only the write that was read is dropped
+		if (auto iter = pending.find(key); iter != pending.end() && iter->second.lsn == lsn) {
+			pending.erase(iter);
+		}
+		break;
+	default:
+		return false;
+	}
+	pos = recordEnd;
+	return true;
+}
+
+/* Segmented write-ahead log with group commit.
+ * Appends go to a memory buffer which a flusher thread writes and syncs every
+ * `syncInterval`, so 1 `fdatasync()` covers every record appended in the meantime.
+ * Segments are named 'wal-<index>.log' and start with a header; a checkpoint segment
+ * (written by compaction) holds the complete pending state up to and including its index.
+ */
+class Log
+{
+private:
+	constexpr static char MAGIC[8] = "DDQWAL";
+	constexpr static uint32_t VERSION = 1;
+	constexpr static uint32_t FLAG_CHECKPOINT = 1;
+	constexpr static size_t HEADER_SIZE = sizeof (MAGIC) + 2 * sizeof (uint32_t);
+	
+	const DurabilityConfig m_config;
+	const std::filesystem::path m_directory;
+	
+	std::mutex m_lock;
+	std::condition_variable m_wakeFlusher, m_flushed, m_wakeCompactor;
+	std::string m_buffer;
+	uint64_t m_nAppended = 0, m_nDurable = 0;
+	int m_error = 0;
+	bool m_stop = false;
+	std::atomic<uint64_t> m_activeSegment = 0;
+	bool m_compactionRequested = false;
+	
+	int m_fd = -1; // only used by the flusher thread once it runs
+	size_t m_segmentSize = 0;
+	std::thread m_flusher, m_compactor;
+	
+	
+	[[nodiscard]] std::filesystem::path _segment_path(const uint64_t index) const {
+		char name[32];
+		snprintf(name, sizeof (name), "wal-%016lx.log", index);
+		return m_directory / name;
+	}
+	
+	[[nodiscard]] std::vector<uint64_t> _list_segments() const {
+		std::vector<uint64_t> indices;
+		for (const auto &entry : std::filesystem::directory_iterator(m_directory)) {
+			const std::string name = entry.path().filename();
+			unsigned long index;
+			char suffix[8] = {};
+			if (sscanf(name.c_str(), "wal-%16lx.%4s", &index, suffix) == 2 && std::string_view(suffix) == "log") {
+				indices.push_back(index);
+			}
+		}
+		std::sort(indices.begin(), indices.end());
+		return indices;
+	}
+	
+	static void _throw_errno(const int error, const std::string &what) {
+		throw std::system_error{ error, std::generic_category(), what };
+	}
+	
+	static void _write_all(const int fd, const std::string_view data) {
+		size_t offset = 0;
+		while (offset < data.size()) {
+			const ssize_t n = write(fd, data.data() + offset, data.size() - offset);
+			if (n < 0 && errno == EINTR) { continue; }
+			if (n < 0) { _throw_errno(errno, "write(wal)"); }
+			offset += size_t(n);
+		}
+	}
+	
+	/* Makes creations, renames and removals of segments durable. */
+	void _sync_directory() const {
+		const int fd = open(m_directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) { _throw_errno(errno, "open(" + m_directory.string() + ")"); }
+		const int result = fsync(fd);
+		const int error = errno;
+		close(fd);
+		if (result != 0) { _throw_errno(error, "fsync(" + m_directory.string() + ")"); }
+	}
+	
+	/* Creates segment `index` and writes its header, returns its file descriptor. */
+	[[nodiscard]] int _create_segment(const std::filesystem::path &path, const uint32_t flags) const {
+		const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0) { _throw_errno(errno, "open(" + path.string() + ")"); }
+		
+		std::string header(MAGIC, sizeof (MAGIC));
+		Utils::Serializer<uint32_t>::write(header, VERSION);
+		Utils::Serializer<uint32_t>::write(header, flags);
+		try {
+			_write_all(fd, header);
+		}
+		catch (...) {
+			close(fd);
+			throw;
+		}
+		return fd;
+	}
+	
+	/* Replays 1 segment into `pending`, stops at the first torn record. */
+	void _replay_segment(const uint64_t index, PendingMap &pending) const {
+		const std::filesystem::path path = _segment_path(index);
+		std::string data;
+		if (FILE *file = fopen(path.c_str(), "rb")) {
+			char buf[1 << 16];
+			for (size_t n; (n = fread(buf, 1, sizeof (buf), file)) > 0; ) { data.append(buf, n); }
+			fclose(file);
+		}
+		if (data.size() < HEADER_SIZE || memcmp(data.data(), MAGIC, sizeof (MAGIC)) != 0) {
+			return; // created but the header never made it to disk
+		}
+		
+		const char *pos = data.data() + sizeof (MAGIC);
+		const char *const end = data.data() + data.size();
+		uint32_t version, flags;
+		if (!Utils::Serializer<uint32_t>::read(pos, end, version) || version != VERSION
+			|| !Utils::Serializer<uint32_t>::read(pos, end, flags))
+		{
+			throw Utils::snapshot_format_exception{ path, "unsupported WAL segment" };
+		}
+		if (flags & FLAG_CHECKPOINT) { pending.clear(); }
+		while (pos < end && apply(pending, pos, end)) {}
+	}
+	
+	void _flush_loop() {
+		std::unique_lock<std::mutex> uniqueLock{ m_lock };
+		while (true) {
+			m_wakeFlusher.wait_for(uniqueLock, m_config.syncInterval, [this]() {
+				return m_stop || m_buffer.size() >= m_config.flushBytes;
+			});
+			if (m_buffer.empty()) {
+				if (m_stop) { break; }
+				continue;
+			}
+			
+			std::string data;
+			data.swap(m_buffer);
+			const uint64_t nAppended = m_nAppended;
+			uniqueLock.unlock();
+			
+			int error = 0;
+			bool rotated = false;
+			try {
+				_write_all(m_fd, data);
+				if (fdatasync(m_fd) != 0) { _throw_errno(errno, "fdatasync(wal)"); }
+				m_segmentSize += data.size();
+				if (m_segmentSize >= m_config.segmentBytes) {
+					const uint64_t next = m_activeSegment.load() + 1;
+					const int fd = _create_segment(_segment_path(next), 0);
+					close(m_fd);
+					m_fd = fd;
+					m_segmentSize = HEADER_SIZE;
+					m_activeSegment.store(next);
+					_sync_directory();
+					rotated = true;
+				}
+			}
+			catch (const std::system_error &e) {
+				error = e.code().value();
+			}
+			
+			uniqueLock.lock();
+			if (error != 0) { m_error = error; }
+			else { m_nDurable = nAppended; }
+			m_flushed.notify_all();
+			if (rotated) {
+				m_compactionRequested = true;
+				m_wakeCompactor.notify_one();
+			}
+		}
+	}
+	
+	void _compact_loop() {
+		std::unique_lock<std::mutex> uniqueLock{ m_lock };
+		while (true) {
+			m_wakeCompactor.wait(uniqueLock, [this]() { return m_stop || m_compactionRequested; });
+			if (m_stop) { break; }
+			m_compactionRequested = false;
+			uniqueLock.unlock();
+			try {
+				_compact();
+			}
+			catch (const std::exception &e) {
+				fprintf(stderr, "WAL compaction failed: %s\n", e.what());
+			}
+			uniqueLock.lock();
+		}
+	}
+	
+	/* Replays the closed segments and replaces them with a checkpoint which only holds the writes
+	 * that are still pending, which is at most 1 per key thanks to deduplication.
+	 * The checkpoint takes the index of the last closed segment, so a crash before the older
+	 * segments are removed only replays them before the checkpoint resets the state. */
+	void _compact() {
+		const uint64_t active = m_activeSegment.load();
+		std::vector<uint64_t> closed = _list_segments();
+		closed.erase(std::remove_if(closed.begin(), closed.end(), [active](uint64_t i) { return i >= active; }), closed.end());
+		if (closed.size() < m_config.compactSegments) { return; }
+		
+		PendingMap pending;
+		for (const uint64_t index : closed) { _replay_segment(index, pending); }
+		
+		std::vector<std::pair<const std::string*, const PendingWrite*>> writes;
+		writes.reserve(pending.size());
+		for (const auto &[key, write] : pending) { writes.emplace_back(&key, &write); }
+		std::sort(writes.begin(), writes.end(), [](const auto &a, const auto &b) {
+			return a.second->lsn < b.second->lsn;
+		});
+		
+		/* Closes the checkpoint and removes it unless it has been renamed over the last closed segment. */
+		struct TmpCheckpoint {
+			const std::filesystem::path path;
+			int fd;
+			bool committed = false;
+			
+			~TmpCheckpoint() {
+				if (fd >= 0) { close(fd); }
+				if (!committed) {
+					std::error_code ignored;
+					std::filesystem::remove(path, ignored);
+				}
+			}
+		};
+		
+		TmpCheckpoint tmp{ m_directory / "checkpoint.tmp", -1 };
+		tmp.fd = _create_segment(tmp.path, FLAG_CHECKPOINT);
+		std::string buffer;
+		for (const auto &[key, write] : writes) {
+			buffer += encode(RecordType::WRITE, write->lsn, *key, write->value);
+			if (buffer.size() >= m_config.flushBytes) {
+				_write_all(tmp.fd, buffer);
+				buffer.clear();
+			}
+		}
+		_write_all(tmp.fd, buffer);
+		if (fdatasync(tmp.fd) != 0) { _throw_errno(errno, "fdatasync(checkpoint)"); }
+		const int closeResult = close(tmp.fd);
+		tmp.fd = -1;
+		if (closeResult != 0) { _throw_errno(errno, "close(checkpoint)"); }
+		
+		std::filesystem::rename(tmp.path, _segment_path(closed.back()));
+		tmp.committed = true;
+		_sync_directory(); // throws before the segments the checkpoint replaces are removed
+		for (size_t i = 0; i + 1 < closed.size(); ++i) {
+			std::filesystem::remove(_segment_path(closed[i]));
+		}
+		_sync_directory();
+	}
+public:
+	Log(const DurabilityConfig &config)
+		: m_config{ config }
+		, m_directory{ config.directory }
+	{
+		std::filesystem::create_directories(m_directory);
+	}
+	
+	Log(const Log&) = delete;
+	Log& operator=(const Log&) = delete;
+	
+	~Log() {
+		{
+			DECL_LOCK_GUARD(m_lock);
+			m_stop = true;
+		}
+		m_wakeFlusher.notify_all();
+		m_wakeCompactor.notify_all();
+		if (m_flusher.joinable()) { m_flusher.join(); }
+		if (m_compactor.joinable()) { m_compactor.join(); }
+		if (m_fd >= 0) { close(m_fd); }
+	}
+	
+	/* Replays every segment and returns the writes that haven't been read. */
+	[[nodiscard]] PendingMap recover() const {
+		PendingMap pending;
+		for (const uint64_t index : _list_segments()) { _replay_segment(index, pending); }
+		return pending;
+	}
+	
+	/* Starts a new segment after the recovered ones and starts the background threads. */
+	void start() {
+		const std::vector<uint64_t> segments = _list_segments();
+		const uint64_t index = segments.empty() ? 0 : segments.back() + 1;
+		m_fd = _create_segment(_segment_path(index), 0);
+		m_segmentSize = HEADER_SIZE;
+		m_activeSegment.store(index);
+		_sync_directory();
+		
+		m_flusher = std::thread{ &Log::_flush_loop, this };
+		m_compactor = std::thread{ &Log::_compact_loop, this };
+	}
+	
+	/* Buffers `record`, returns a ticket for `wait_durable()`. */
+	uint64_t append(const std::string_view record) {
+		DECL_LOCK_GUARD(m_lock);
+		if (m_error != 0) { _throw_errno(m_error, "wal"); }
+		m_buffer.append(record);
+		if (m_buffer.size() >= m_config.flushBytes) { m_wakeFlusher.notify_one(); }
+		return ++m_nAppended;
+	}
+	
+	/* Blocks until the record with `ticket` (and every record before it) has been synced. */
+	void wait_durable(const uint64_t ticket) {
+		std::unique_lock<std::mutex> uniqueLock{ m_lock };
+		m_flushed.wait(uniqueLock, [this, ticket]() { return m_nDurable >= ticket || m_error != 0; });
+		if (m_error != 0) { _throw_errno(m_error, "wal"); }
+	}
+	
+	/* Blocks until everything appended so far has been synced. */
+	void sync() {
+		uint64_t ticket;
+		{
+			DECL_LOCK_GUARD(m_lock);
+			ticket = m_nAppended;
+		}
+		m_wakeFlusher.notify_one();
+		wait_durable(ticket);
+	}
+};
+
+template<typename Value>
+struct Entry {
+	Value value;
+	uint64_t lsn;
+};
+
+}
+
+/* Makes any queue implementation survive crashes by logging every write and read
+ * to a write-ahead log (see `Impl::DurableQueue::Log`) in `config.directory`.
+ * The items found in the log are written to the queue when it's constructed.
+ *
+ * Writes and reads of the same key are logged in the order they happen by locking 1 of
+ * `N_STRIPES` mutexes picked by the key's hash. Every write gets a log sequence number (LSN)
+ * which is stored next to the value, so a read only cancels the write it returned.
+ * A write is logged before it's published, and cancelled in the log when the queue rejects it.
+ * Reads aren't synced before they return, after a crash the last reads can be delivered again.
+ */
+template<template<typename, typename> typename Queue, typename Key, typename Value>
+class DurableQueue
+{
+private:
+	using Entry = Impl::DurableQueue::Entry<Value>;
+	using RecordType = Impl::DurableQueue::RecordType;
+	constexpr static size_t N_STRIPES = 64;
+	
+	const bool m_waitForSync;
+	Queue<Key, Entry> m_queue;
+	Impl::DurableQueue::Log m_log;
+	std::array<std::mutex, N_STRIPES> m_stripes;
+	std::atomic<uint64_t> m_nextLsn;
+	
+	[[nodiscard]] std::mutex& _stripe(const Key &key) {
+		return m_stripes[std::hash<Key>{}(key) % N_STRIPES];
+	}
+	
+	/* Logs that the write of `entry` has been read, returns the item without its LSN. */
+	std::pair<Key, Value> _consume(Key &&key, Entry &&entry) {
+		std::string keyBytes;
+		Utils::Serializer<Key>::write(keyBytes, key);
+		{
+			// waits for the writer of this entry to log it, so the read is always logged after it
+			DECL_LOCK_GUARD(_stripe(key));
+			m_log.append(Impl::DurableQueue::encode(RecordType::CONSUME, entry.lsn, keyBytes, {}));
+		}
+		return { std::move(key), std::move(entry.value) };
+	}
+	
+	void _recover() {
+		Impl::DurableQueue::PendingMap pending = m_log.recover();
+		std::vector<std::pair<const std::string*, Impl::DurableQueue::PendingWrite*>> writes;
+		for (auto &[key, write] : pending) { writes.emplace_back(&key, &write); }
+		std::sort(writes.begin(), writes.end(), [](const auto &a, const auto &b) {
+			return a.second->lsn < b.second->lsn;
+		});
+		
+		uint64_t maxLsn = 0;
+		usize nDropped = 0;
+		for (auto &[keyBytes, write] : writes) {
+			Key key;
+			Value value;
+			const char *keyPos = keyBytes->data(), *valuePos = write->value.data();
+			if (!Utils::Serializer<Key>::read(keyPos, keyPos + keyBytes->size(), key)
+				|| !Utils::Serializer<Value>::read(valuePos, valuePos + write->value.size(), value))
+			{
+				throw Utils::snapshot_format_exception{ "wal", "undecodable record" };
+			}
+			maxLsn = std::max(maxLsn, write->lsn);
+			nDropped += !m_queue.try_write(std::move(key), Entry{ std::move(value), write->lsn });
+		}
+		m_nextLsn.store(maxLsn + 1);
+		if (!writes.empty()) {
+			printf("Recovered %'zu items from the write-ahead log.\n", writes.size() - nDropped);
+		}
+		if (nDropped > 0) {
+			printf("\e[31mDropped %'u recovered items over capacity.\e[m\n", nDropped);
+		}
+	}
+public:
+	using KVPair = std::pair<Key, Value>;
+	using key_type = Key;
+	using value_type = Value;
+	constexpr static bool BOUNDED = Queue<Key, Entry>::BOUNDED;
+	
+	/* `args` are passed to the constructor of the queue, e.g the capacity. */
+	template<typename ...Args>
+	DurableQueue(const DurabilityConfig &config, Args &&...args)
+		: m_waitForSync{ config.waitForSync }
+		, m_queue(std::forward<Args>(args)...)
+		, m_log{ config }
+		, m_nextLsn{ 1 }
+	{
+		_recover();
+		m_log.start();
+	}
+	
+	[[nodiscard]] usize size() { return m_queue.size(); }
+	[[nodiscard]] usize capacity() const { return m_queue.capacity(); }
+	[[nodiscard]] bool stopped() const { return m_queue.stopped(); }
+	void stop() { m_queue.stop(); }
+	[[nodiscard]] bool writes_closed() const { return m_queue.writes_closed(); }
+	
+	/* Holds every stripe, so a writer that saw the queue open under its stripe can publish. */
+	void close_writes() {
+		for (std::mutex &stripe : m_stripes) { stripe.lock(); }
+		m_queue.close_writes();
+		for (std::mutex &stripe : m_stripes) { stripe.unlock(); }
+	}
+	
+	void stop_now() { m_queue.stop_now(); }
+	
+	/* Like `drain()` of the queue, doesn't wait for the reads to be synced. */
+	bool drain() { return m_queue.drain(); }
+	
+	/* Blocks until every write and read so far has been synced. */
+	void sync() { m_log.sync(); }
+	
+	bool try_write(Key &&key, Value &&value) {
+		std::string keyBytes, valueBytes;
+		Utils::Serializer<Key>::write(keyBytes, key);
+		Utils::Serializer<Value>::write(valueBytes, value);
+		
+		uint64_t ticket;
+		{
+			DECL_LOCK_GUARD(_stripe(key));
+			if (m_queue.writes_closed()) { throw Utils::queue_closed_exception{}; }
+			
+			// logged before it's published, so an item that can be read is never missing from the log
+			const uint64_t lsn = m_nextLsn.fetch_add(1);
+			ticket = m_log.append(Impl::DurableQueue::encode(RecordType::WRITE, lsn, keyBytes, valueBytes));
+			if (!m_queue.try_write(std::move(key), Entry{ std::move(value), lsn })) {
+				// only a new key is rejected (over capacity), so there's no older write this would cancel
+				m_log.append(Impl::DurableQueue::encode(RecordType::CONSUME, lsn, keyBytes, {}));
+				return false;
+			}
+		}
+		if (m_waitForSync) { m_log.wait_durable(ticket); }
+		return true;
+	}
+	
+	/* Returns `std::nullopt` instead of waiting when the queue is empty. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		std::optional data = m_queue.try_read();
+		if (!data.has_value()) { return std::nullopt; }
+		return _consume(std::move(data->first), std::move(data->second));
+	}
+	
+	KVPair read() {
+		auto [key, entry] = m_queue.read();
+		return _consume(std::move(key), std::move(entry));
+	}
+};
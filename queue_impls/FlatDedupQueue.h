@@ -0,0 +1,301 @@
+#pragma once
+#include "utils.h"
+#include <memory>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+namespace Impl::FlatDedupQueue
+{
+	/* Number of control bytes compared by 1 probe step. */
+	constexpr size_t GROUP_SIZE = 32;
+	
+	constexpr uint8_t EMPTY = 0x80;
+	constexpr uint8_t DELETED = 0xFE; // like EMPTY, the high bit is never set in a fingerprint
+	
+	/* Bit `i` of each mask is set when control byte `i` of a group matches. */
+	struct GroupMasks {
+		uint32_t match; // the fingerprint
+		uint32_t empty;
+		uint32_t free; // empty or deleted
+	};
+	
+	inline GroupMasks match_group_scalar(const uint8_t *ctrl, const uint8_t fingerprint) {
+		GroupMasks masks{ 0, 0, 0 };
+		for (size_t i = 0; i < GROUP_SIZE; ++i) {
+			masks.match |= uint32_t{ ctrl[i] == fingerprint } << i;
+			masks.empty |= uint32_t{ ctrl[i] == EMPTY } << i;
+			masks.free |= uint32_t(ctrl[i] >> 7) << i;
+		}
+		return masks;
+	}
+
+#if defined(__SSE2__)
+	inline GroupMasks match_group_sse2(const uint8_t *ctrl, const uint8_t fingerprint) {
+		const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+		const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl + 16));
+		const __m128i fp = _mm_set1_epi8(static_cast<char>(fingerprint));
+		const __m128i empty = _mm_set1_epi8(static_cast<char>(EMPTY));
+		const auto to_mask = [](const __m128i lo, const __m128i hi) {
+			return uint32_t(_mm_movemask_epi8(lo)) | (uint32_t(_mm_movemask_epi8(hi)) << 16);
+		};
+		return GroupMasks{
+			to_mask(_mm_cmpeq_epi8(lo, fp), _mm_cmpeq_epi8(hi, fp)), // match
+			to_mask(_mm_cmpeq_epi8(lo, empty), _mm_cmpeq_epi8(hi, empty)), // empty
+			to_mask(lo, hi), // free
+		};
+	}
+	
+	__attribute__((target("avx2")))
+	inline GroupMasks match_group_avx2(const uint8_t *ctrl, const uint8_t fingerprint) {
+		const __m256i group = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ctrl));
+		const __m256i fp = _mm256_set1_epi8(static_cast<char>(fingerprint));
+		const __m256i empty = _mm256_set1_epi8(static_cast<char>(EMPTY));
+		return GroupMasks{
+			uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(group, fp))), // match
+			uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(group, empty))), // empty
+			uint32_t(_mm256_movemask_epi8(group)), // free
+		};
+	}
+#endif
+	
+	/* Implementations of the group compare, the probe loops are instantiated once per implementation. */
+	enum class Isa { SCALAR, SSE2, AVX2 };
+	
+	[[nodiscard]] inline const char* isa_name(const Isa isa) {
+		switch (isa)
+		{
+		case Isa::SSE2: return "SSE2";
+		case Isa::AVX2: return "AVX2";
+		default: return "scalar";
+		}
+	}
+	
+	/* Widest implementation supported by the CPU, detected once per process. */
+	[[nodiscard]] inline Isa isa_for_cpu() {
+#if defined(__SSE2__)
+		static const Isa isa = []() {
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2") ? Isa::AVX2 : Isa::SSE2;
+		}();
+		return isa;
+#else
+		return Isa::SCALAR;
+#endif
+	}
+}
+
+
+namespace Utils
+{
+	/* Whether keys and values are small and trivially copyable enough to be stored inline
+	 * in `FlatDedupQueue` instead of in the nodes of a `std::map`. */
+	template<typename Key, typename Value>
+	constexpr bool is_inline_v = std::is_trivially_copyable_v<Key>
+		&& std::is_trivially_copyable_v<Value>
+		&& std::is_default_constructible_v<Key>
+		&& std::is_default_constructible_v<Value>
+		&& (sizeof (Key) + sizeof (Value) <= 64);
+	
+	/* Deduplicating FIFO which stores keys and values inline in a flat open-addressing table.
+	 * Every slot has a control byte which is either empty, deleted or a 7-bit fingerprint of
+	 * the key's hash, so a probe only compares keys whose fingerprint matches. The control
+	 * bytes are compared 32 at a time with SSE2 or AVX2, picked when the queue is created;
+	 * each operation then runs a probe loop instantiated for it, so the compare is inlined.
+	 * The FIFO is a ring of slot indices; every queued item is in it exactly once, which lets
+	 * a rehash rebuild the table and the FIFO in a single pass in FIFO order.
+	 * Not thread-safe, the queues lock around it like they do around `std::map`.
+	 */
+	template<typename Key, typename Value>
+	class FlatDedupQueue
+	{
+	private:
+		static_assert(is_inline_v<Key, Value>);
+		
+		constexpr static size_t GROUP_SIZE = Impl::FlatDedupQueue::GROUP_SIZE;
+		constexpr static uint8_t EMPTY = Impl::FlatDedupQueue::EMPTY;
+		constexpr static uint8_t DELETED = Impl::FlatDedupQueue::DELETED;
+		constexpr static size_t NPOS = ~size_t{ 0 };
+		
+		struct Slot {
+			Key key;
+			Value value;
+		};
+		
+		// the first `GROUP_SIZE` control bytes are mirrored after the last one,
+		// so that a group can be loaded from any slot without wrapping around
+		std::unique_ptr<uint8_t[]> m_ctrl;
+		std::unique_ptr<Slot[]> m_slots;
+		size_t m_mask; // number of slots - 1
+		size_t m_nDeleted;
+		RingQueue<uint32_t> m_fifo;
+		const Impl::FlatDedupQueue::Isa m_isa;
+		
+		/* `std::hash` can be the identity (e.g. for integers), and the sharded queues pick the
+		 * shard from its low bits, so it's mixed (64-bit MurmurHash3 finalizer) before the
+		 * home slot is taken from the low bits and the fingerprint from the high ones. */
+		[[nodiscard]] static uint64_t _hash(const Key &key) {
+			uint64_t hash = std::hash<Key>{}(key);
+			hash ^= hash >> 33;
+			hash *= 0xFF51AFD7ED558CCDull;
+			hash ^= hash >> 33;
+			hash *= 0xC4CEB9FE1A85EC53ull;
+			hash ^= hash >> 33;
+			return hash;
+		}
+		[[nodiscard]] static uint8_t _fingerprint(const uint64_t hash) { return hash >> 57; }
+		[[nodiscard]] static size_t _home(const uint64_t hash) { return hash; }
+		
+		void _set_ctrl(const size_t index, const uint8_t ctrl) {
+			m_ctrl[index] = ctrl;
+			if (index < GROUP_SIZE) { m_ctrl[m_mask + 1 + index] = ctrl; }
+		}
+		
+		using MatchGroup = Impl::FlatDedupQueue::GroupMasks (*)(const uint8_t *ctrl, uint8_t fingerprint);
+		
+		/* Probes slot by slot up to the first empty one, a group at a time. */
+		template<MatchGroup MATCH_GROUP>
+		[[nodiscard]] __attribute__((always_inline))
+		size_t _probe_find(const Key &key, const uint64_t hash) const {
+			const uint8_t fingerprint = _fingerprint(hash);
+			for (size_t pos = _home(hash) & m_mask; ; pos = (pos + GROUP_SIZE) & m_mask) {
+				const Impl::FlatDedupQueue::GroupMasks masks = MATCH_GROUP(&m_ctrl[pos], fingerprint);
+				// only the slots before the first empty one are part of the probe sequence
+				const uint32_t beforeEmpty = (masks.empty & (~masks.empty + 1)) - 1;
+				for (uint32_t match = masks.match & beforeEmpty; match != 0; match &= match - 1) {
+					const size_t index = (pos + __builtin_ctz(match)) & m_mask;
+					if (m_slots[index].key == key) { return index; }
+				}
+				if (masks.empty != 0) { return NPOS; }
+			}
+		}
+		
+		template<MatchGroup MATCH_GROUP>
+		[[nodiscard]] __attribute__((always_inline))
+		size_t _probe_free(const uint64_t hash) const {
+			for (size_t pos = _home(hash) & m_mask; ; pos = (pos + GROUP_SIZE) & m_mask) {
+				if (const uint32_t free = MATCH_GROUP(&m_ctrl[pos], 0).free; free != 0) {
+					return (pos + __builtin_ctz(free)) & m_mask;
+				}
+			}
+		}
+
+#if defined(__SSE2__)
+		// the AVX2 loops need the target attribute for the compare to be inlined into them
+		[[nodiscard]] __attribute__((target("avx2")))
+		size_t _find_avx2(const Key &key, const uint64_t hash) const {
+			return _probe_find<Impl::FlatDedupQueue::match_group_avx2>(key, hash);
+		}
+		
+		[[nodiscard]] __attribute__((target("avx2")))
+		size_t _find_free_avx2(const uint64_t hash) const {
+			return _probe_free<Impl::FlatDedupQueue::match_group_avx2>(hash);
+		}
+#endif
+		
+		[[nodiscard]] size_t _find(const Key &key, const uint64_t hash) const {
+			switch (m_isa)
+			{
+#if defined(__SSE2__)
+			case Impl::FlatDedupQueue::Isa::AVX2: return _find_avx2(key, hash);
+			case Impl::FlatDedupQueue::Isa::SSE2: return _probe_find<Impl::FlatDedupQueue::match_group_sse2>(key, hash);
+#endif
+			default: return _probe_find<Impl::FlatDedupQueue::match_group_scalar>(key, hash);
+			}
+		}
+		
+		[[nodiscard]] size_t _find_free(const uint64_t hash) const {
+			switch (m_isa)
+			{
+#if defined(__SSE2__)
+			case Impl::FlatDedupQueue::Isa::AVX2: return _find_free_avx2(hash);
+			case Impl::FlatDedupQueue::Isa::SSE2: return _probe_free<Impl::FlatDedupQueue::match_group_sse2>(hash);
+#endif
+			default: return _probe_free<Impl::FlatDedupQueue::match_group_scalar>(hash);
+			}
+		}
+		
+		void _allocate(const size_t nSlots) {
+			m_ctrl = std::make_unique<uint8_t[]>(nSlots + GROUP_SIZE);
+			std::fill_n(m_ctrl.get(), nSlots + GROUP_SIZE, EMPTY);
+			m_slots = std::make_unique<Slot[]>(nSlots);
+			m_mask = nSlots - 1;
+			m_nDeleted = 0;
+		}
+		
+		/* Moves every item to a new table with `nSlots` slots, dropping the tombstones. */
+		void _rehash(const size_t nSlots) {
+			std::unique_ptr<uint8_t[]> ctrl = std::move(m_ctrl);
+			std::unique_ptr<Slot[]> slots = std::move(m_slots);
+			RingQueue<uint32_t> fifo{ m_fifo.size() };
+			_allocate(nSlots);
+			
+			while (!m_fifo.empty()) {
+				const Slot &slot = slots[m_fifo.pop()];
+				const uint64_t hash = _hash(slot.key);
+				const size_t index = _find_free(hash);
+				_set_ctrl(index, _fingerprint(hash));
+				m_slots[index] = slot;
+				fifo.push(static_cast<uint32_t>(index));
+			}
+			m_fifo = std::move(fifo);
+		}
+	public:
+		/* `isa` can be set to compare implementations, the CPU must support it. */
+		FlatDedupQueue(const size_t capacity = 16, const Impl::FlatDedupQueue::Isa isa = Impl::FlatDedupQueue::isa_for_cpu())
+			: m_fifo{ capacity }
+			, m_isa{ isa }
+		{
+			_allocate(ceil_pow2(std::max<size_t>(capacity * 2, GROUP_SIZE)));
+		}
+		
+		[[nodiscard]] size_t size() const { return m_fifo.size(); }
+		[[nodiscard]] bool empty() const { return m_fifo.empty(); }
+		
+		[[nodiscard]] Value* find(const Key &key) {
+			const size_t index = _find(key, _hash(key));
+			return (index == NPOS) ? nullptr : &m_slots[index].value;
+		}
+		
+		/* Returns whether `key` was inserted, otherwise its value was replaced. */
+		bool insert_or_assign(const Key &key, const Value &value) {
+			const uint64_t hash = _hash(key);
+			if (const size_t index = _find(key, hash); index != NPOS) {
+				m_slots[index].value = value;
+				return false;
+			}
+			
+			const size_t nSlots = m_mask + 1;
+			if ((size() + m_nDeleted + 1) * 8 > nSlots * 7) { // keep probe sequences short
+				_rehash((size() + 1) * 2 > nSlots ? nSlots * 2 : nSlots);
+			}
+			const size_t index = _find_free(hash);
+			m_nDeleted -= (m_ctrl[index] == DELETED);
+			_set_ctrl(index, _fingerprint(hash));
+			m_slots[index] = Slot{ key, value };
+			m_fifo.push(static_cast<uint32_t>(index));
+			return true;
+		}
+		
+		/* Removes and returns the oldest item, the queue must not be empty. */
+		[[nodiscard]] std::pair<Key, Value> pop() {
+			const size_t index = m_fifo.pop();
+			// a probe never continues past an empty slot, so the slot can be emptied if the next one is
+			const bool tombstone = (m_ctrl[(index + 1) & m_mask] != EMPTY);
+			_set_ctrl(index, tombstone ? DELETED : EMPTY);
+			m_nDeleted += tombstone;
+			return { m_slots[index].key, m_slots[index].value };
+		}
+		
+		/* Calls `fn(key, value)` for every item in FIFO order. */
+		template<typename Fn>
+		void visit(Fn &&fn) {
+			for (size_t i = 0; i < m_fifo.size(); ++i) {
+				const Slot &slot = m_slots[m_fifo[i]];
+				fn(slot.key, slot.value);
+			}
+		}
+	};
+}
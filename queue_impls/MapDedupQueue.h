@@ -0,0 +1,108 @@
+#pragma once
+#include "utils.h"
+#include <deque>
+
+
+namespace Utils
+{
+	/* Deduplicating FIFO made of a `std::map` and a FIFO of map iterators, which can also be
+	 * read in key order. Every item remembers its position in the FIFO (a sequence number),
+	 * so removing it out of FIFO order leaves a hole there which FIFO reads skip; the FIFO is
+	 * rebuilt without holes once they outnumber the items.
+	 * Not thread-safe, the queues lock around it.
+	 */
+	template<typename Key, typename Value>
+	class MapDedupQueue
+	{
+	private:
+		struct Entry {
+			Value value;
+			size_t seq; // the position in `m_fifo` is `seq - m_headSeq`
+		};
+		using Map = std::map<Key, Entry>;
+	public:
+		using iterator = typename Map::iterator;
+	private:
+		Map m_map;
+		std::deque<iterator> m_fifo; // holes are `m_map.end()`, never at the front
+		size_t m_headSeq = 0;
+		size_t m_nHoles = 0;
+		
+		void _trim_front() {
+			while (!m_fifo.empty() && m_fifo.front() == m_map.end()) {
+				m_fifo.pop_front();
+				++m_headSeq;
+				--m_nHoles;
+			}
+		}
+		
+		void _compact() {
+			std::deque<iterator> fifo;
+			for (const iterator iter : m_fifo) {
+				if (iter == m_map.end()) { continue; }
+				iter->second.seq = fifo.size();
+				fifo.push_back(iter);
+			}
+			m_fifo = std::move(fifo);
+			m_headSeq = 0;
+			m_nHoles = 0;
+		}
+		
+		[[nodiscard]] std::pair<Key, Value> _erase(const iterator iter) {
+			auto node = m_map.extract(iter);
+			return { std::move(node.key()), std::move(node.mapped().value) };
+		}
+	public:
+		[[nodiscard]] size_t size() const { return m_map.size(); }
+		[[nodiscard]] bool empty() const { return m_map.empty(); }
+		
+		[[nodiscard]] Value* find(const Key &key) {
+			const iterator iter = m_map.find(key);
+			return (iter == m_map.end()) ? nullptr : &iter->second.value;
+		}
+		
+		/* Returns whether `key` was inserted, otherwise its value was replaced. */
+		bool insert_or_assign(Key &&key, Value &&value) {
+			iterator iter = m_map.lower_bound(key);
+			if (iter != m_map.end() && !(key < iter->first)) {
+				iter->second.value = std::move(value);
+				return false;
+			}
+			iter = m_map.emplace_hint(iter, std::move(key), Entry{ std::move(value), m_headSeq + m_fifo.size() });
+			m_fifo.push_back(iter);
+			return true;
+		}
+		
+		/* Removes and returns the oldest item, the queue must not be empty. */
+		[[nodiscard]] std::pair<Key, Value> pop() {
+			const iterator iter = m_fifo.front();
+			m_fifo.pop_front();
+			++m_headSeq;
+			_trim_front();
+			return _erase(iter);
+		}
+		
+		/* Items in key order, for `extract()`. */
+		[[nodiscard]] iterator begin() { return m_map.begin(); }
+		[[nodiscard]] iterator end() { return m_map.end(); }
+		[[nodiscard]] iterator lower_bound(const Key &key) { return m_map.lower_bound(key); }
+		
+		/* Removes and returns the item at `iter` regardless of its FIFO position. */
+		[[nodiscard]] std::pair<Key, Value> extract(const iterator iter) {
+			m_fifo[iter->second.seq - m_headSeq] = m_map.end();
+			++m_nHoles;
+			_trim_front();
+			std::pair<Key, Value> result = _erase(iter);
+			if (m_nHoles > m_map.size()) { _compact(); }
+			return result;
+		}
+		
+		/* Calls `fn(key, value)` for every item in FIFO order. */
+		template<typename Fn>
+		void visit(Fn &&fn) {
+			for (const iterator iter : m_fifo) {
+				if (iter != m_map.end()) { fn(iter->first, iter->second.value); }
+			}
+		}
+	};
+}
@@ -0,0 +1,257 @@
+#pragma once
+#include "utils.h"
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+namespace Utils::Numa
+{
+	/* Parses a CPU (or node) list of sysfs like "0-3,8-11". */
+	[[nodiscard]] inline std::vector<int> parse_cpulist(const std::string_view list) {
+		std::vector<int> cpus;
+		for (size_t pos = 0; pos < list.size(); ) {
+			const size_t end = std::min(list.find(',', pos), list.size());
+			const std::string range{ list.substr(pos, end - pos) };
+			int first, last;
+			switch (sscanf(range.c_str(), "%d-%d", &first, &last))
+			{
+			case 1:
+				cpus.push_back(first);
+				break;
+			case 2:
+				for (int cpu = first; cpu <= last; ++cpu) { cpus.push_back(cpu); }
+				break;
+			}
+			pos = end + 1;
+		}
+		return cpus;
+	}
+	
+	/* CPUs the calling thread may run on. */
+	[[nodiscard]] inline std::vector<int> allowed_cpus() {
+		cpu_set_t set;
+		std::vector<int> cpus;
+		if (sched_getaffinity(0, sizeof (set), &set) == 0) {
+			for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+				if (CPU_ISSET(cpu, &set)) { cpus.push_back(cpu); }
+			}
+		}
+		if (cpus.empty()) { cpus.push_back(0); }
+		return cpus;
+	}
+	
+	/* NUMA nodes and their CPUs, nodes are referred to by their index in `nodes`. */
+	struct Topology
+	{
+		struct Node {
+			int id; // for `mbind()`
+			std::vector<int> cpus;
+		};
+		
+		std::vector<Node> nodes;
+		bool simulated = false; // the nodes don't exist, so memory isn't bound to them
+		
+		[[nodiscard]] size_t node_count() const { return nodes.size(); }
+		
+		[[nodiscard]] size_t node_of_cpu(const int cpu) const {
+			for (size_t node = 0; node < nodes.size(); ++node) {
+				if (std::find(nodes[node].cpus.begin(), nodes[node].cpus.end(), cpu) != nodes[node].cpus.end()) {
+					return node;
+				}
+			}
+			return 0;
+		}
+		
+		/* Splits the allowed CPUs into `nNodes` contiguous groups, nodes share a CPU
+		 * when there are fewer CPUs than nodes. */
+		[[nodiscard]] static Topology simulate(const size_t nNodes) {
+			const std::vector<int> cpus = allowed_cpus();
+			Topology topology{ {}, true };
+			for (size_t node = 0; node < std::max<size_t>(nNodes, 1); ++node) {
+				const size_t first = node * cpus.size() / nNodes, last = (node + 1) * cpus.size() / nNodes;
+				std::vector<int> nodeCpus{ cpus.begin() + first, cpus.begin() + last };
+				if (nodeCpus.empty()) { nodeCpus.push_back(cpus[node % cpus.size()]); }
+				topology.nodes.push_back({ static_cast<int>(node), std::move(nodeCpus) });
+			}
+			return topology;
+		}
+		
+		/* Reads '/sys/devices/system/node', or simulates `NUMA_SIMULATE_NODES` nodes
+		 * when that environment variable is set, to test on single-node machines. */
+		[[nodiscard]] static Topology detect() {
+			if (const char *env = getenv("NUMA_SIMULATE_NODES"); env != nullptr && atoi(env) > 0) {
+				return simulate(atoi(env));
+			}
+			
+			Topology topology;
+			std::string list;
+			std::ifstream online{ "/sys/devices/system/node/online" };
+			if (std::getline(online, list)) {
+				for (const int id : parse_cpulist(list)) {
+					std::ifstream file{ "/sys/devices/system/node/node" + std::to_string(id) + "/cpulist" };
+					if (std::getline(file, list) && !parse_cpulist(list).empty()) { // skips memory-only nodes
+						topology.nodes.push_back({ id, parse_cpulist(list) });
+					}
+				}
+			}
+			if (topology.nodes.empty()) { topology.nodes.push_back({ 0, allowed_cpus() }); }
+			return topology;
+		}
+		
+		/* Detected once per process. */
+		[[nodiscard]] static const Topology& system() {
+			static const Topology topology = detect();
+			return topology;
+		}
+	};
+	
+	namespace Impl
+	{
+		inline thread_local int t_pinnedNode = -1;
+		
+		[[nodiscard]] inline cpu_set_t cpu_set(const std::vector<int> &cpus) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (const int cpu : cpus) { CPU_SET(cpu, &set); }
+			return set;
+		}
+	}
+	
+	/* Restricts the calling thread to the CPUs of `node`, which `current_node()` returns from now on. */
+	inline bool pin_thread(const Topology &topology, const size_t node) {
+		const cpu_set_t set = Impl::cpu_set(topology.nodes[node].cpus);
+		if (sched_setaffinity(0, sizeof (set), &set) != 0) { return false; }
+		Impl::t_pinnedNode = static_cast<int>(node);
+		return true;
+	}
+	
+	/* Node the calling thread runs on, or is pinned to (simulated nodes can share CPUs). */
+	[[nodiscard]] inline size_t current_node(const Topology &topology) {
+		if (Impl::t_pinnedNode >= 0) { return size_t(Impl::t_pinnedNode) % topology.node_count(); }
+		const int cpu = sched_getcpu();
+		return (cpu < 0) ? 0 : topology.node_of_cpu(cpu);
+	}
+	
+	/* Memory of 1 node, carved into blocks with a free list per 16-byte size class.
+	 * Chunks are bound to the node with `mbind()`, or first touched by the calling thread
+	 * temporarily pinned to the node when that isn't permitted (e.g in containers), so the
+	 * pages don't end up on the node of whichever thread happens to touch them first.
+	 * Not thread-safe, shards only use it under their lock.
+	 */
+	class Arena
+	{
+	public:
+		constexpr static size_t ALIGN = 16;
+	private:
+		constexpr static size_t CHUNK_SIZE = 256 << 10;
+		constexpr static size_t MAX_BLOCK = 1024; // larger allocations get their own mapping
+		
+		const int m_nodeId;
+		const std::vector<int> m_cpus;
+		const bool m_bind;
+		std::vector<void*> m_chunks;
+		char *m_cursor = nullptr, *m_end = nullptr;
+		std::array<void*, MAX_BLOCK / ALIGN + 1> m_free{}; // each free block holds the next one
+		
+		void _bind(void *memory, const size_t bytes) const {
+			std::vector<unsigned long> mask(m_nodeId / 64 + 1, 0);
+			mask[m_nodeId / 64] |= 1ul << (m_nodeId % 64);
+			if (syscall(SYS_mbind, memory, bytes, MPOL_BIND, mask.data(), mask.size() * 64 + 1, 0) == 0) {
+				return;
+			}
+			
+			cpu_set_t saved;
+			const cpu_set_t set = Impl::cpu_set(m_cpus);
+			if (sched_getaffinity(0, sizeof (saved), &saved) != 0 || sched_setaffinity(0, sizeof (set), &set) != 0) {
+				return;
+			}
+			for (size_t offset = 0; offset < bytes; offset += 4096) {
+				static_cast<volatile char*>(memory)[offset] = 0;
+			}
+			sched_setaffinity(0, sizeof (saved), &saved);
+		}
+		
+		[[nodiscard]] void* _map(const size_t bytes) const {
+			void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (memory == MAP_FAILED) { throw std::bad_alloc{}; }
+			if (m_bind) { _bind(memory, bytes); }
+			return memory;
+		}
+		
+		[[nodiscard]] static size_t _round(const size_t bytes) { return (bytes + ALIGN - 1) & ~(ALIGN - 1); }
+	public:
+		Arena(const Topology &topology, const size_t node)
+			: m_nodeId{ topology.nodes[node].id }
+			, m_cpus{ topology.nodes[node].cpus }
+			, m_bind{ !topology.simulated && topology.node_count() > 1 }
+		{}
+		
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+		
+		~Arena() {
+			for (void *chunk : m_chunks) { munmap(chunk, CHUNK_SIZE); }
+		}
+		
+		[[nodiscard]] void* allocate(const size_t bytes) {
+			const size_t size = _round(bytes);
+			if (size > MAX_BLOCK) { return _map(size); }
+			
+			if (void *&head = m_free[size / ALIGN]; head != nullptr) {
+				void *block = head;
+				head = *static_cast<void**>(block);
+				return block;
+			}
+			if (size_t(m_end - m_cursor) < size) { // the rest of the chunk is left unused
+				m_chunks.push_back(_map(CHUNK_SIZE));
+				m_cursor = static_cast<char*>(m_chunks.back());
+				m_end = m_cursor + CHUNK_SIZE;
+			}
+			void *block = m_cursor;
+			m_cursor += size;
+			return block;
+		}
+		
+		void deallocate(void *block, const size_t bytes) {
+			const size_t size = _round(bytes);
+			if (size > MAX_BLOCK) {
+				munmap(block, size);
+				return;
+			}
+			void *&head = m_free[size / ALIGN];
+			*static_cast<void**>(block) = head;
+			head = block;
+		}
+	};
+	
+	/* Standard allocator on top of an `Arena`. */
+	template<typename T>
+	struct ArenaAllocator
+	{
+		static_assert(alignof (T) <= Arena::ALIGN);
+		using value_type = T;
+		
+		Arena *arena;
+		
+		ArenaAllocator(Arena &arena) : arena{ &arena } {}
+		template<typename U>
+		ArenaAllocator(const ArenaAllocator<U> &other) : arena{ other.arena } {}
+		
+		[[nodiscard]] T* allocate(const size_t n) { return static_cast<T*>(arena->allocate(n * sizeof (T))); }
+		void deallocate(T *p, const size_t n) { arena->deallocate(p, n * sizeof (T)); }
+	};
+	
+	template<typename T, typename U>
+	bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena == b.arena; }
+	template<typename T, typename U>
+	bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena != b.arena; }
+}
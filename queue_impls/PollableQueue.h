@@ -0,0 +1,129 @@
+#pragma once
+#include "BaseQueue.h"
+#include <optional>
+#include <string>
+#include <system_error>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+/* Adds an eventfd to any implementation, so that an epoll (or poll/select) loop can wait on
+ * many queues and sockets at once instead of dedicating a sleeping reader thread to each queue.
+ * `fd()` becomes readable when the queue goes from drained to non-empty and when it is stopped
+ * or closed for writes.
+ *
+ * Signals are coalesced: only the first write after the consumer called `acknowledge()`
+ * touches the eventfd, later writes only check a flag. In exchange the consumer must drain
+ * the queue (until `try_read()` returns `std::nullopt`) after every acknowledgement,
+ * which `read_ready()` does. Works with both level- and edge-triggered epoll.
+ * Key-ordered reads (`read_sorted_batch()`, `read_range()`) only remove items, so they
+ * don't need to signal anything.
+ */
+template<typename Queue>
+class PollableQueue : public Queue
+{
+public:
+	using Key = typename Queue::key_type;
+	using Value = typename Queue::value_type;
+private:
+	const int m_fd;
+	std::atomic<bool> m_signaled; // whether the eventfd has been written since the last acknowledgement
+	
+	[[nodiscard]] static int _create_eventfd() {
+		const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0) {
+			throw std::system_error{ errno, std::generic_category(), "eventfd()" };
+		}
+		return fd;
+	}
+	
+	/* Writers publish their item before checking the flag and the consumer clears the flag
+	 * before draining, with a full fence in between on both sides, so either the consumer
+	 * sees the item or the writer sees the cleared flag. TSan doesn't support fences,
+	 * there every writer exchanges the flag instead. */
+	void _signal() {
+#if defined(__SANITIZE_THREAD__)
+		if (m_signaled.exchange(true, std::memory_order_acq_rel)) { return; }
+#else
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_signaled.load(std::memory_order_relaxed) || m_signaled.exchange(true)) { return; }
+#endif
+		eventfd_write(m_fd, 1); // can only fail when the counter overflows, which keeps it readable
+	}
+	
+	void _signal_always() {
+		m_signaled.store(true);
+		eventfd_write(m_fd, 1);
+	}
+public:
+	template<typename ...ARGS>
+	PollableQueue(ARGS &&...args)
+		: Queue(std::forward<ARGS>(args)...)
+		, m_fd{ _create_eventfd() }
+		, m_signaled{ false }
+	{}
+	
+	PollableQueue(const PollableQueue&) = delete;
+	PollableQueue& operator=(const PollableQueue&) = delete;
+	
+	~PollableQueue() { close(m_fd); }
+	
+	/* Non-blocking eventfd to register for `EPOLLIN`, owned by the queue. */
+	[[nodiscard]] int fd() const { return m_fd; }
+	
+	/* Clears the readiness of `fd()`, the queue must be drained afterwards. */
+	void acknowledge() {
+		eventfd_t count;
+		eventfd_read(m_fd, &count); // fails with EAGAIN when it wasn't signaled, which is fine
+#if defined(__SANITIZE_THREAD__)
+		m_signaled.exchange(false, std::memory_order_acq_rel);
+#else
+		m_signaled.store(false, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+	}
+	
+	/* Acknowledges the readiness of `fd()` and calls `fn(key, value)` for every item until
+	 * the queue is empty, returns how many items were read. */
+	template<typename Fn>
+	usize read_ready(Fn &&fn) {
+		acknowledge();
+		usize nRead = 0;
+		while (std::optional data = this->try_read()) {
+			fn(std::move(data->first), std::move(data->second));
+			++nRead;
+		}
+		return nRead;
+	}
+	
+	bool try_write(Key &&key, Value &&value) {
+		const bool written = Queue::try_write(std::move(key), std::move(value));
+		if (written) { _signal(); }
+		return written;
+	}
+	
+	/* Writes the items of the snapshot at `path`, then signals `fd()` like `try_write()`. */
+	usize restore(const std::string &path) {
+		const usize nRestored = Queue::restore(path);
+		if (nRestored > 0) { _signal(); }
+		return nRestored;
+	}
+	
+	/* Also signals `fd()`, so that the consumer can see `stopped()` (after draining). */
+	void stop() {
+		Queue::stop();
+		_signal_always();
+	}
+	
+	/* Also signals `fd()`, so that the consumer can see `writes_closed()` (after draining). */
+	void close_writes() {
+		Queue::close_writes();
+		_signal_always();
+	}
+	
+	void stop_now() {
+		Queue::stop_now();
+		_signal_always();
+	}
+};
@@ -1,23 +1,130 @@
 #pragma once
 #include "BaseQueue.h"
+#include "FlatDedupQueue.h"
+#include "MapDedupQueue.h"
+#include <optional>
+#include <vector>
 
 
 /* Single global lock.
  * This is the simplest and acts as a reference implementation.
+ * Besides FIFO reads, items can be read in key order with `read_sorted_batch()` and `read_range()`.
  */
-template<typename Key, typename Value>
+template<typename Key, typename Value, typename = void>
 class Queue_1Lock : public BaseQueue<Key, Value>
 {
 private:
 	using BaseQ = BaseQueue<Key, Value>;
 	using typename BaseQ::KVPair;
 	
-	Utils::Queue<typename std::map<Key, Value>::iterator> m_queue;
-	std::map<Key, Value> m_map;
+	Utils::MapDedupQueue<Key, Value> m_queue;
+	std::mutex m_lock;
+	
+	/* Removes up to `maxItems` items from `first` (inclusive) to `last` (exclusive) in key order,
+	 * `nullptr` bounds are open. */
+	[[nodiscard]] std::vector<KVPair> _read_sorted(const Key *first, const Key *last, const usize maxItems) {
+		DECL_LOCK_GUARD(m_lock);
+		std::vector<KVPair> batch;
+		auto iter = (first == nullptr) ? m_queue.begin() : m_queue.lower_bound(*first);
+		while (iter != m_queue.end() && batch.size() < maxItems && (last == nullptr || iter->first < *last)) {
+			batch.push_back(m_queue.extract(iter++));
+		}
+		return batch;
+	}
+public:
+	Queue_1Lock(const usize capacity)
+		: BaseQ{ capacity }
+	{}
+	
+	[[nodiscard]] usize size() {
+		DECL_LOCK_GUARD(m_lock);
+		return m_queue.size();
+	}
+	
+	/* Writes the queued items to `path` in FIFO order, see 'Snapshot.h'. */
+	void snapshot(const std::string &path) {
+		Snapshot::write_file<Key, Value>(path, 1, [this](uint32_t, auto &section) {
+			DECL_LOCK_GUARD(m_lock);
+			m_queue.visit(section);
+		});
+	}
+	
+	/* Writes the items of the snapshot at `path` to this queue, returns how many were accepted. */
+	usize restore(const std::string &path) { return Snapshot::restore(*this, path); }
+	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
+	bool try_write(Key &&key, Value &&value) {
+		DECL_LOCK_GUARD(m_lock);
+		if (this->writes_closed()) {
+			throw Utils::queue_closed_exception{};
+		}
+		if (m_queue.size() >= this->capacity()) { // try to dedup
+			Value *existing = m_queue.find(key);
+			if (existing == nullptr) {
+				return false;
+			}
+			*existing = std::move(value);
+			return true;
+		}
+		m_queue.insert_or_assign(std::move(key), std::move(value));
+		return true;
+	}
+	
+	/* Returns `std::nullopt` instead of waiting when the queue is empty. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		DECL_LOCK_GUARD(m_lock);
+		if (m_queue.empty()) { return std::nullopt; }
+		return m_queue.pop();
+	}
+	
+	/* Removes and returns the (up to) `maxItems` items with the smallest keys, in key order.
+	 * Returns fewer items instead of waiting when the queue has fewer. */
+	[[nodiscard]] std::vector<KVPair> read_sorted_batch(const usize maxItems) {
+		return _read_sorted(nullptr, nullptr, maxItems);
+	}
+	
+	/* Removes and returns the items with keys from `first` (inclusive) to `last` (exclusive),
+	 * in key order, up to `maxItems` of them. */
+	[[nodiscard]] std::vector<KVPair> read_range(const Key &first, const Key &last, const usize maxItems = ~usize{ 0 }) {
+		return _read_sorted(&first, &last, maxItems);
+	}
+	
+	constexpr KVPair read() {
+		while (true) {
+			if (std::optional data = try_read()) {
+				return *data;
+			}
+			
+			if (this->stopped()) {
+				throw Utils::queue_stopped_exception{};
+			}
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
+		}
+	}
+};
+
+/* Single global lock, with small trivially copyable keys and values stored inline
+ * in a `Utils::FlatDedupQueue` instead of in `std::map` nodes.
+ * The table isn't ordered, so there are no key-ordered reads.
+ */
+template<typename Key, typename Value>
+class Queue_1Lock<Key, Value, std::enable_if_t<Utils::is_inline_v<Key, Value>>> : public BaseQueue<Key, Value>
+{
+private:
+	using BaseQ = BaseQueue<Key, Value>;
+	using typename BaseQ::KVPair;
+	
+	Utils::FlatDedupQueue<Key, Value> m_queue;
 	std::mutex m_lock;
 public:
 	Queue_1Lock(const usize capacity)
 		: BaseQ{ capacity }
+		, m_queue{ capacity }
 	{}
 	
 	[[nodiscard]] usize size() {
@@ -25,31 +132,57 @@ public:
 		return m_queue.size();
 	}
 	
+	/* Writes the queued items to `path` in FIFO order, see 'Snapshot.h'. */
+	void snapshot(const std::string &path) {
+		Snapshot::write_file<Key, Value>(path, 1, [this](uint32_t, auto &section) {
+			DECL_LOCK_GUARD(m_lock);
+			m_queue.visit(section);
+		});
+	}
+	
+	/* Writes the items of the snapshot at `path` to this queue, returns how many were accepted. */
+	usize restore(const std::string &path) { return Snapshot::restore(*this, path); }
+	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
 	bool try_write(Key &&key, Value &&value) {
 		DECL_LOCK_GUARD(m_lock);
+		if (this->writes_closed()) {
+			throw Utils::queue_closed_exception{};
+		}
 		if (m_queue.size() >= this->capacity()) { // try to dedup
-			auto iter = m_map.find(key);
-			if (iter == m_map.end()) {
+			Value *existing = m_queue.find(key);
+			if (existing == nullptr) {
 				return false;
 			}
-			iter->second = std::move(value);
+			*existing = value;
 			return true;
 		}
-		auto [iter, inserted] = m_map.insert_or_assign(std::move(key), std::move(value));
-		if (inserted) { m_queue.push(iter); }
+		m_queue.insert_or_assign(key, value);
 		return true;
 	}
 	
+	/* Returns `std::nullopt` instead of waiting when the queue is empty. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		DECL_LOCK_GUARD(m_lock);
+		if (m_queue.empty()) { return std::nullopt; }
+		return m_queue.pop();
+	}
+	
 	constexpr KVPair read() {
 		while (true) {
-			if (DECL_LOCK_GUARD(m_lock); !m_queue.empty()) {
-				return Utils::map_pop_iter(m_map, m_queue.pop());
+			if (std::optional data = try_read()) {
+				return *data;
 			}
 			
 			if (this->stopped()) {
 				throw Utils::queue_stopped_exception{};
 			}
-			Utils::sleep(WAIT_TIME);
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
 		}
 	}
 };
@@ -1,12 +1,15 @@
 #pragma once
 #include "BaseQueue.h"
+#include "FlatDedupQueue.h"
+#include "MapDedupQueue.h"
 #include <optional>
+#include <vector>
 
 
 namespace Impl::Queue_1LockSharded
 {
 
-template<typename BaseQueue>
+template<typename BaseQueue, typename = void>
 class Shard
 {
 private:
@@ -14,8 +17,7 @@ private:
 	using Key = typename BaseQueue::key_type;
 	using Value = typename BaseQueue::value_type;
 	
-	Utils::Queue<typename std::map<Key, Value>::iterator> m_queue;
-	std::map<Key, Value> m_map;
+	Utils::MapDedupQueue<Key, Value> m_queue;
 	std::mutex m_lock;
 public:
 	Shard() = default;
@@ -23,40 +25,124 @@ public:
 	bool write(Key &&key, Value &&value, bool dedupOnly) {
 		DECL_LOCK_GUARD(m_lock);
 		if (dedupOnly) {
-			auto iter = m_map.find(key);
-			if (iter == m_map.end()) {
+			Value *existing = m_queue.find(key);
+			if (existing == nullptr) {
 				return false;
 			}
-			iter->second = std::move(value);
+			*existing = std::move(value);
 			return true;
 		}
-		auto [iter, inserted] = m_map.insert_or_assign(std::move(key), std::move(value));
-		if (inserted) { m_queue.push(iter); }
-		return !inserted;
+		return !m_queue.insert_or_assign(std::move(key), std::move(value));
 	}
 	
 	[[nodiscard]] std::optional<KVPair> try_read() {
 		DECL_LOCK_GUARD(m_lock);
 		if (m_queue.empty()) { return std::nullopt; }
-		return Utils::map_pop_iter(m_map, m_queue.pop());
+		return m_queue.pop();
+	}
+	
+	/* Calls `fn(key, value)` for every queued item in FIFO order. */
+	template<typename Fn>
+	void visit(Fn &&fn) {
+		DECL_LOCK_GUARD(m_lock);
+		m_queue.visit(fn);
 	}
+	
+	/* For reads across shards, `locked_queue()` may only be used while the lock is held. */
+	[[nodiscard]] std::unique_lock<std::mutex> lock() { return std::unique_lock<std::mutex>{ m_lock }; }
+	[[nodiscard]] Utils::MapDedupQueue<Key, Value>& locked_queue() { return m_queue; }
 };
 
-template<typename Key, typename Value, size_t N_SHARDS>
+/* Shard with small trivially copyable keys and values stored inline, see 'FlatDedupQueue.h'. */
+template<typename BaseQueue>
+class Shard<BaseQueue, std::enable_if_t<Utils::is_inline_v<typename BaseQueue::key_type, typename BaseQueue::value_type>>>
+{
+private:
+	using KVPair = typename BaseQueue::KVPair;
+	using Key = typename BaseQueue::key_type;
+	using Value = typename BaseQueue::value_type;
+	
+	Utils::FlatDedupQueue<Key, Value> m_queue;
+	std::mutex m_lock;
+public:
+	Shard() = default;
+	
+	bool write(const Key &key, const Value &value, bool dedupOnly) {
+		DECL_LOCK_GUARD(m_lock);
+		if (dedupOnly) {
+			Value *existing = m_queue.find(key);
+			if (existing == nullptr) {
+				return false;
+			}
+			*existing = value;
+			return true;
+		}
+		return !m_queue.insert_or_assign(key, value);
+	}
+	
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		DECL_LOCK_GUARD(m_lock);
+		if (m_queue.empty()) { return std::nullopt; }
+		return m_queue.pop();
+	}
+	
+	/* Calls `fn(key, value)` for every queued item in FIFO order. */
+	template<typename Fn>
+	void visit(Fn &&fn) {
+		DECL_LOCK_GUARD(m_lock);
+		m_queue.visit(fn);
+	}
+};
+
+template<typename Key, typename Value>
 class ShardArray : public BaseQueue<Key, Value>
 {
 private:
 	using BaseQ = BaseQueue<Key, Value>;
 	using typename BaseQ::KVPair;
 	
-	std::array<Shard<BaseQ>, N_SHARDS> m_shards;
+	std::vector<Shard<BaseQ>> m_shards;
+	const usize m_shardMask;
 	std::atomic<usize> m_size;
 	
 	[[nodiscard]] constexpr static
 	usize _index_from_key(const Key &key) { return std::hash<Key>{}(key); }
+	
+	/* K-way merge of the shards from `first` (inclusive) to `last` (exclusive), `nullptr` bounds
+	 * are open. Every shard is locked for the whole merge, in index order so that concurrent
+	 * merges can't deadlock (other operations only lock 1 shard). */
+	[[nodiscard]] std::vector<KVPair> _read_sorted(const Key *first, const Key *last, const usize maxItems) {
+		using Iterator = typename Utils::MapDedupQueue<Key, Value>::iterator;
+		using Cursor = std::pair<Iterator, usize>; // next item of a shard, shard index
+		const auto greater = [](const Cursor &a, const Cursor &b) { return b.first->first < a.first->first; };
+		std::priority_queue<Cursor, std::vector<Cursor>, decltype(greater)> cursors{ greater };
+		
+		std::vector<std::unique_lock<std::mutex>> locks;
+		locks.reserve(m_shards.size());
+		for (usize i = 0; i < m_shards.size(); ++i) {
+			locks.push_back(m_shards[i].lock());
+			auto &queue = m_shards[i].locked_queue();
+			const Iterator iter = (first == nullptr) ? queue.begin() : queue.lower_bound(*first);
+			if (iter != queue.end() && (last == nullptr || iter->first < *last)) { cursors.push({ iter, i }); }
+		}
+		
+		std::vector<KVPair> batch;
+		while (!cursors.empty() && batch.size() < maxItems) {
+			auto [iter, i] = cursors.top();
+			cursors.pop();
+			auto &queue = m_shards[i].locked_queue();
+			batch.push_back(queue.extract(iter++));
+			if (iter != queue.end() && (last == nullptr || iter->first < *last)) { cursors.push({ iter, i }); }
+		}
+		m_size.fetch_sub(batch.size());
+		return batch;
+	}
 public:
-	ShardArray(const usize capacity)
+	/* `nShards` is rounded up to a power of 2. */
+	ShardArray(const usize capacity, const usize nShards = Utils::default_shard_count())
 		: BaseQ{ capacity }
+		, m_shards(Utils::ceil_pow2(nShards))
+		, m_shardMask{ static_cast<usize>(m_shards.size() - 1) }
 		, m_size{ 0 }
 	{}
 	
@@ -64,10 +150,34 @@ public:
 		return m_size.load();
 	}
 	
+	[[nodiscard]] usize shard_count() const { return m_shards.size(); }
+	
+	/* Writes the queued items to `path` with 1 section per shard, see 'Snapshot.h'.
+	 * Shards are copied one at a time, so writers only wait for the shard being copied. */
+	void snapshot(const std::string &path) {
+		Snapshot::write_file<Key, Value>(path, m_shards.size(), [this](uint32_t index, auto &section) {
+			m_shards[index].visit(section);
+		});
+	}
+	
+	/* Writes the items of the snapshot at `path` to this queue, returns how many were accepted. */
+	usize restore(const std::string &path) { return Snapshot::restore(*this, path); }
+	
+	/* Index of the shard `key` is queued in, FIFO order only holds within a shard. */
+	[[nodiscard]] constexpr
+	usize fifo_index(const Key &key) const { return _index_from_key(key) & m_shardMask; }
+	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
 	bool try_write(Key &&key, Value &&value) {
 		const bool overflow = (m_size.fetch_add(1) >= this->capacity());
+		if (this->writes_closed()) { // after reserving, see `close_writes()`
+			m_size.fetch_sub(1);
+			throw Utils::queue_closed_exception{};
+		}
 		
-		auto &shard = m_shards[_index_from_key(key) % N_SHARDS];
+		auto &shard = m_shards[fifo_index(key)];
 		const bool deduped = shard.write(std::move(key), std::move(value), overflow);
 		
 		if (overflow || deduped) {
@@ -76,19 +186,46 @@ public:
 		return !overflow || deduped;
 	}
 	
+	/* Returns `std::nullopt` instead of waiting when the queue is empty. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		for (auto &shard : m_shards) {
+			if (std::optional data = shard.try_read()) {
+				m_size.fetch_sub(1);
+				return data;
+			}
+		}
+		return std::nullopt;
+	}
+	
+	/* Removes and returns the (up to) `maxItems` items with the smallest keys across all shards,
+	 * in key order. Returns fewer items instead of waiting when the queue has fewer.
+	 * Only for keys stored in `std::map`, the inline table isn't ordered so the queue has no
+	 * key-ordered reads when `Utils::is_inline_v<Key, Value>`. */
+	template<typename K = Key, std::enable_if_t<!Utils::is_inline_v<K, Value>, int> = 0>
+	[[nodiscard]] std::vector<KVPair> read_sorted_batch(const usize maxItems) {
+		return _read_sorted(nullptr, nullptr, maxItems);
+	}
+	
+	/* Removes and returns the items with keys from `first` (inclusive) to `last` (exclusive),
+	 * in key order, up to `maxItems` of them. Only for keys stored in `std::map`. */
+	template<typename K = Key, std::enable_if_t<!Utils::is_inline_v<K, Value>, int> = 0>
+	[[nodiscard]] std::vector<KVPair> read_range(const Key &first, const Key &last, const usize maxItems = ~usize{ 0 }) {
+		return _read_sorted(&first, &last, maxItems);
+	}
+	
 	constexpr KVPair read() {
 		while (true) {
-			for (auto &shard : m_shards) {
-				if (std::optional data = shard.try_read()) {
-					m_size.fetch_sub(1);
-					return *data;
-				}
+			if (std::optional data = try_read()) {
+				return *data;
 			}
 			
 			if (this->stopped()) {
 				throw Utils::queue_stopped_exception{};
 			}
-			Utils::sleep(WAIT_TIME);
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
 		}
 	}
 };
@@ -97,6 +234,9 @@ public:
 
 /* An array of queues that never compete and each have 1 lock.
  * Round-robin is used to find the correct queue when reading.
+ * Small trivially copyable keys and values are stored inline, see 'FlatDedupQueue.h'.
+ * Other keys can also be read in key order, merged across the shards (with inline keys
+ * `read_sorted_batch()` and `read_range()` don't exist).
  */
-template<typename Key, typename Value, size_t N_SHARDS>
-using Queue_1LockSharded = Impl::Queue_1LockSharded::ShardArray<Key, Value, N_SHARDS>;
+template<typename Key, typename Value>
+using Queue_1LockSharded = Impl::Queue_1LockSharded::ShardArray<Key, Value>;
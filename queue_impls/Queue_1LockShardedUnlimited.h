@@ -1,6 +1,7 @@
 #pragma once
 #include "BaseQueue.h"
 #include <optional>
+#include <vector>
 
 
 namespace Impl::Queue_1LockShardedUnlimited
@@ -14,12 +15,17 @@ private:
 	using Key = typename BaseQueue::key_type;
 	using Value = typename BaseQueue::value_type;
 	
-	Utils::Queue<typename std::map<Key, Value>::iterator> m_queue;
+	Utils::RingQueue<typename std::map<Key, Value>::iterator> m_queue;
 	std::map<Key, Value> m_map;
 	std::mutex m_lock;
 public:
 	Shard() = default;
 	
+	void reserve(const usize capacity) {
+		DECL_LOCK_GUARD(m_lock);
+		if (m_queue.empty()) { m_queue = decltype(m_queue){ capacity }; }
+	}
+	
 	bool write(Key &&key, Value &&value) {
 		DECL_LOCK_GUARD(m_lock);
 		auto [iter, inserted] = m_map.insert_or_assign(std::move(key), std::move(value));
@@ -32,57 +38,120 @@ public:
 		if (m_queue.empty()) { return std::nullopt; }
 		return Utils::map_pop_iter(m_map, m_queue.pop());
 	}
+	
+	/* Calls `fn(key, value)` for every queued item in FIFO order. */
+	template<typename Fn>
+	void visit(Fn &&fn) {
+		DECL_LOCK_GUARD(m_lock);
+		for (usize i = 0; i < m_queue.size(); ++i) { fn(m_queue[i]->first, m_queue[i]->second); }
+	}
 };
 
-template<typename Key, typename Value, size_t N_SHARDS>
+template<typename Key, typename Value>
 class ShardArray : public BaseQueue<Key, Value>
 {
 private:
 	using BaseQ = BaseQueue<Key, Value>;
 	using typename BaseQ::KVPair;
 	
-	std::array<Shard<BaseQ>, N_SHARDS> m_shards;
-	std::atomic<usize> m_readIndex, m_writeIndex;
+	std::vector<Shard<BaseQ>> m_shards;
+	const usize m_shardMask;
 	std::atomic<usize> m_size;
+	
+	[[nodiscard]] constexpr static
+	usize _index_from_key(const Key &key) { return std::hash<Key>{}(key); }
+	
+	/* Readers start scanning at a different shard every time (and from every thread). */
+	[[nodiscard]] static usize _next_read_offset() {
+		thread_local usize t_offset = std::hash<std::thread::id>{}(std::this_thread::get_id());
+		return t_offset++;
+	}
 public:
-	ShardArray(const usize capacity)
+	constexpr static bool BOUNDED = false;
+	
+	/* `capacity` only sizes the initial storage, the shards grow past it as needed.
+	 * `nShards` is rounded up to a power of 2. */
+	ShardArray(const usize capacity, const usize nShards = Utils::default_shard_count())
 		: BaseQ{ capacity }
-		, m_readIndex{ 0 }
-		, m_writeIndex{ 0 }
+		, m_shards(Utils::ceil_pow2(nShards))
+		, m_shardMask{ static_cast<usize>(m_shards.size() - 1) }
 		, m_size{ 0 }
-	{}
+	{
+		for (auto &shard : m_shards) { shard.reserve(capacity / m_shards.size()); }
+	}
 	
 	[[nodiscard]] constexpr usize size() {
 		return m_size.load();
 	}
 	
+	[[nodiscard]] usize shard_count() const { return m_shards.size(); }
+	
+	/* Writes the queued items to `path` with 1 section per shard, see 'Snapshot.h'.
+	 * Shards are copied one at a time, so writers only wait for the shard being copied. */
+	void snapshot(const std::string &path) {
+		Snapshot::write_file<Key, Value>(path, m_shards.size(), [this](uint32_t index, auto &section) {
+			m_shards[index].visit(section);
+		});
+	}
+	
+	/* Writes the items of the snapshot at `path` to this queue, returns how many were accepted. */
+	usize restore(const std::string &path) { return Snapshot::restore(*this, path); }
+	
+	/* Index of the shard `key` is queued in, FIFO order only holds within a shard. */
+	[[nodiscard]] constexpr
+	usize fifo_index(const Key &key) const { return _index_from_key(key) & m_shardMask; }
+	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
+	/* Never fails for open queues, new keys grow the shard they hash to. */
 	bool try_write(Key &&key, Value &&value) {
-		auto &shard = m_shards[m_writeIndex.fetch_add(1) % N_SHARDS];
-		const bool inserted = shard.write(std::move(key), std::move(value));
-		if (inserted) {
-			m_size.fetch_add(inserted);
+		m_size.fetch_add(1); // before inserting so that readers never decrement it first
+		if (this->writes_closed()) { // after reserving, see `close_writes()`
+			m_size.fetch_sub(1);
+			throw Utils::queue_closed_exception{};
+		}
+		auto &shard = m_shards[fifo_index(key)];
+		if (!shard.write(std::move(key), std::move(value))) {
+			m_size.fetch_sub(1);
 		}
 		return true;
 	}
 	
-	constexpr KVPair read() {
-		auto &shard = m_shards[m_readIndex.fetch_add(1) % N_SHARDS];
+	/* Returns `std::nullopt` instead of waiting when the queue is empty. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		const usize offset = _next_read_offset();
+		for (usize i = 0; i < m_shards.size(); ++i) {
+			if (std::optional data = m_shards[(offset + i) & m_shardMask].try_read()) {
+				m_size.fetch_sub(1);
+				return data;
+			}
+		}
+		return std::nullopt;
+	}
+	
+	KVPair read() {
 		while (true) {
-			for (usize i = 0; i < N_SHARDS; ++i) { // several attempts
-				if (std::optional data = shard.try_read()) {
-					m_size.fetch_sub(1);
-					return *data;
-				}
+			if (std::optional data = try_read()) {
+				return *data;
 			}
 			
 			if (this->stopped()) {
 				throw Utils::queue_stopped_exception{};
 			}
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
 		}
 	}
 };
 
 }
 
-template<typename Key, typename Value, size_t N_SHARDS>
-using Queue_1LockShardedUnlimited = Impl::Queue_1LockShardedUnlimited::ShardArray<Key, Value, N_SHARDS>;
+/* An array of queues that never compete and each have 1 lock, without a capacity limit.
+ * Keys are routed to shards by their hash like in the bounded implementation,
+ * and each shard keeps its FIFO in a ring buffer which doubles when full.
+ */
+template<typename Key, typename Value>
+using Queue_1LockShardedUnlimited = Impl::Queue_1LockShardedUnlimited::ShardArray<Key, Value>;
@@ -30,13 +30,33 @@ public:
 		: BaseQ{ capacity }
 	{}
 	
+	/* Items are counted from the map, which writers insert into first. */
 	[[nodiscard]] usize size() {
-		DECL_LOCK_GUARD(m_queueLock);
-		return m_queue.size();
+		DECL_LOCK_GUARD(m_mapLock);
+		return m_map.size();
 	}
 	
+	/* Writes the queued items to `path` in FIFO order, see 'Snapshot.h'.
+	 * Items which are in the map but not in the queue yet are still being written and are skipped. */
+	void snapshot(const std::string &path) {
+		Snapshot::write_file<Key, Value>(path, 1, [this](uint32_t, auto &section) {
+			DECL_LOCK_GUARD(m_queueLock);
+			DECL_LOCK_GUARD(m_mapLock);
+			for (const auto &iter : m_queue) { section(iter->first, iter->second); }
+		});
+	}
+	
+	/* Writes the items of the snapshot at `path` to this queue, returns how many were accepted. */
+	usize restore(const std::string &path) { return Snapshot::restore(*this, path); }
+	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
 	bool try_write(Key &&key, Value &&value) {
 		std::unique_lock<std::mutex> uniqueLock{ m_mapLock };
+		if (this->writes_closed()) {
+			throw Utils::queue_closed_exception{};
+		}
 		if (m_map.size() >= this->capacity()) { // try to dedup
 			auto iter = m_map.find(key);
 			if (iter == m_map.end()) {
@@ -54,18 +74,27 @@ public:
 		return true;
 	}
 	
+	/* Returns `std::nullopt` instead of waiting when the queue is empty. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		std::optional iter = _locked_queue_pop();
+		if (!iter.has_value()) { return std::nullopt; }
+		DECL_LOCK_GUARD(m_mapLock);
+		return Utils::map_pop_iter(m_map, *iter);
+	}
+	
 	KVPair read() {
 		while (true) {
-			std::optional iter = _locked_queue_pop();
-			if (iter.has_value()) {
-				DECL_LOCK_GUARD(m_mapLock);
-				return Utils::map_pop_iter(m_map, *iter);
+			if (std::optional data = try_read()) {
+				return *data;
 			}
 			
 			if (this->stopped()) {
 				throw Utils::queue_stopped_exception{};
 			}
-			Utils::sleep(WAIT_TIME);
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
 		}
 	}
 };
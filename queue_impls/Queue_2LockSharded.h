@@ -1,11 +1,34 @@
 #pragma once
 #include "BaseQueue.h"
 #include <optional>
+#include <shared_mutex> // std::shared_lock
+#include <vector>
 
 
 namespace Impl::Queue_2LockSharded
 {
 
+/* Whether values can be replaced with a lock-free atomic store. */
+template<typename Value>
+constexpr bool is_atomic_cell_v = []() {
+	if constexpr (std::is_trivially_copyable_v<Value>) { return std::atomic<Value>::is_always_lock_free; }
+	else { return false; }
+}();
+
+/* Map value which a dedup hit can replace while other writers hold the same shared lock. */
+template<typename Value>
+class AtomicCell
+{
+private:
+	std::atomic<Value> m_value;
+public:
+	AtomicCell(const Value &value) : m_value{ value } {}
+	
+	// the map lock orders the accesses to the map, the cell only has to be free of torn values
+	[[nodiscard]] Value load() const { return m_value.load(std::memory_order_relaxed); }
+	void store(const Value &value) { m_value.store(value, std::memory_order_relaxed); }
+};
+
 template<typename BaseQueue>
 class Shard
 {
@@ -13,30 +36,70 @@ private:
 	using KVPair = typename BaseQueue::KVPair;
 	using Key = typename BaseQueue::key_type;
 	using Value = typename BaseQueue::value_type;
+	constexpr static bool ATOMIC_VALUES = is_atomic_cell_v<Value>;
+	using Cell = std::conditional_t<ATOMIC_VALUES, AtomicCell<Value>, Value>;
+	using Map = std::map<Key, Cell>;
+	constexpr static int DEDUP_SCORE_MAX = 16;
 	
-	Utils::Queue<typename std::map<Key, Value>::iterator> m_queue;
-	std::map<Key, Value> m_map;
-	std::mutex m_queueLock, m_mapLock;
+	Utils::Queue<typename Map::iterator> m_queue;
+	Map m_map;
+	std::mutex m_queueLock;
+	Utils::ReadMostlyMutex m_mapLock; // shared for dedup hits, exclusive for inserts and erases
+	// rises with dedup hits and falls with inserts, the shared probe is skipped at 0
+	// so that mostly unique keys don't pay for a second lookup
+	std::atomic<int> m_dedupScore{ DEDUP_SCORE_MAX };
+	
+	/* A racy heuristic: concurrent updates may be lost, which only delays the switch. */
+	void _score(const bool hit) {
+		const int score = m_dedupScore.load(std::memory_order_relaxed);
+		if (hit ? (score < DEDUP_SCORE_MAX) : (score > 0)) {
+			m_dedupScore.store(score + (hit ? 1 : -1), std::memory_order_relaxed);
+		}
+	}
 	
-	[[nodiscard]] std::optional<typename std::map<Key, Value>::iterator> _locked_queue_pop() {
+	[[nodiscard]] std::optional<typename Map::iterator> _locked_queue_pop() {
 		DECL_LOCK_GUARD(m_queueLock);
 		if (m_queue.empty()) { return std::nullopt; }
 		return m_queue.pop();
 	}
+	
+	[[nodiscard]] static const Value& _value(const Value &cell) { return cell; }
+	[[nodiscard]] static Value _value(const AtomicCell<Value> &cell) { return cell.load(); }
+	
+	static void _assign(Value &cell, Value &&value) { cell = std::move(value); }
+	static void _assign(AtomicCell<Value> &cell, Value &&value) { cell.store(value); }
 public:
 	Shard() = default;
 	
 	bool write(Key &&key, Value &&value, bool dedupOnly) {
-		std::unique_lock<std::mutex> uniqueLock{ m_mapLock };
+		if constexpr (ATOMIC_VALUES) { // no structural change for a dedup hit
+			if (dedupOnly || m_dedupScore.load(std::memory_order_relaxed) > 0) {
+				std::shared_lock<Utils::ReadMostlyMutex> sharedLock{ m_mapLock };
+				auto iter = m_map.find(key);
+				if (iter != m_map.end()) {
+					iter->second.store(value);
+					_score(true);
+					return true;
+				}
+				if (dedupOnly) {
+					return false;
+				}
+			}
+		}
+		
+		std::unique_lock<Utils::ReadMostlyMutex> uniqueLock{ m_mapLock };
 		if (dedupOnly) {
 			auto iter = m_map.find(key);
 			if (iter == m_map.end()) {
 				return false;
 			}
-			iter->second = std::move(value);
+			_assign(iter->second, std::move(value));
 			return true;
 		}
-		auto [iter, inserted] = m_map.insert_or_assign(std::move(key), std::move(value));
+		// `try_emplace()` leaves the arguments alone when the key exists
+		auto [iter, inserted] = m_map.try_emplace(std::move(key), std::move(value));
+		if (!inserted) { _assign(iter->second, std::move(value)); }
+		if constexpr (ATOMIC_VALUES) { _score(!inserted); }
 		uniqueLock.unlock();
 		if (inserted) {
 			DECL_LOCK_GUARD(m_queueLock);
@@ -48,28 +111,43 @@ public:
 	[[nodiscard]] std::optional<KVPair> try_read() {
 		std::optional iter = _locked_queue_pop();
 		if (iter.has_value()) {
-			DECL_LOCK_GUARD(m_mapLock);
-			return Utils::map_pop_iter(m_map, *iter);
+			std::lock_guard<Utils::ReadMostlyMutex> lockGuard{ m_mapLock };
+			KVPair data{ (*iter)->first, _value((*iter)->second) };
+			m_map.erase(*iter);
+			return data;
 		}
 		return std::nullopt;
 	}
+	
+	/* Calls `fn(key, value)` for every item in the queue in FIFO order,
+	 * items which are in the map but not in the queue yet are skipped. */
+	template<typename Fn>
+	void visit(Fn &&fn) {
+		DECL_LOCK_GUARD(m_queueLock);
+		std::shared_lock<Utils::ReadMostlyMutex> sharedLock{ m_mapLock };
+		for (const auto &iter : m_queue) { fn(iter->first, _value(iter->second)); }
+	}
 };
 
-template<typename Key, typename Value, size_t N_SHARDS>
+template<typename Key, typename Value>
 class ShardArray : public BaseQueue<Key, Value>
 {
 private:
 	using BaseQ = BaseQueue<Key, Value>;
 	using typename BaseQ::KVPair;
 	
-	std::array<Shard<BaseQ>, N_SHARDS> m_shards;
+	std::vector<Shard<BaseQ>> m_shards;
+	const usize m_shardMask;
 	std::atomic<usize> m_size;
 	
 	[[nodiscard]] constexpr static
 	usize _index_from_key(const Key &key) { return std::hash<Key>{}(key); }
 public:
-	ShardArray(const usize capacity)
+	/* `nShards` is rounded up to a power of 2. */
+	ShardArray(const usize capacity, const usize nShards = Utils::default_shard_count())
 		: BaseQ{ capacity }
+		, m_shards(Utils::ceil_pow2(nShards))
+		, m_shardMask{ static_cast<usize>(m_shards.size() - 1) }
 		, m_size{ 0 }
 	{}
 	
@@ -77,10 +155,34 @@ public:
 		return m_size.load();
 	}
 	
+	[[nodiscard]] usize shard_count() const { return m_shards.size(); }
+	
+	/* Writes the queued items to `path` with 1 section per shard, see 'Snapshot.h'.
+	 * Shards are copied one at a time, so writers only wait for the shard being copied. */
+	void snapshot(const std::string &path) {
+		Snapshot::write_file<Key, Value>(path, m_shards.size(), [this](uint32_t index, auto &section) {
+			m_shards[index].visit(section);
+		});
+	}
+	
+	/* Writes the items of the snapshot at `path` to this queue, returns how many were accepted. */
+	usize restore(const std::string &path) { return Snapshot::restore(*this, path); }
+	
+	/* Index of the shard `key` is queued in, FIFO order only holds within a shard. */
+	[[nodiscard]] constexpr
+	usize fifo_index(const Key &key) const { return _index_from_key(key) & m_shardMask; }
+	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
 	bool try_write(Key &&key, Value &&value) {
 		const bool overflow = (m_size.fetch_add(1) >= this->capacity());
+		if (this->writes_closed()) { // after reserving, see `close_writes()`
+			m_size.fetch_sub(1);
+			throw Utils::queue_closed_exception{};
+		}
 		
-		auto &shard = m_shards[_index_from_key(key) % N_SHARDS];
+		auto &shard = m_shards[fifo_index(key)];
 		const bool deduped = shard.write(std::move(key), std::move(value), overflow);
 		
 		if (overflow || deduped) {
@@ -89,19 +191,30 @@ public:
 		return !overflow || deduped;
 	}
 	
+	/* Returns `std::nullopt` instead of waiting when the queue is empty. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		for (auto &shard : m_shards) {
+			if (std::optional data = shard.try_read()) {
+				m_size.fetch_sub(1);
+				return data;
+			}
+		}
+		return std::nullopt;
+	}
+	
 	constexpr KVPair read() {
 		while (true) {
-			for (auto &shard : m_shards) {
-				if (std::optional data = shard.try_read()) {
-					m_size.fetch_sub(1);
-					return *data;
-				}
+			if (std::optional data = try_read()) {
+				return *data;
 			}
 			
 			if (this->stopped()) {
 				throw Utils::queue_stopped_exception{};
 			}
-			Utils::sleep(WAIT_TIME);
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
 		}
 	}
 };
@@ -115,6 +228,8 @@ public:
  * the queue and map can be locked separately when ordered correctly:
  * write(map) -> write(queue) -> read(queue) -> read(map)
  * This shows that an item can only be removed from the map if it was added to the queue.
+ * When values have a lock-free `std::atomic`, a write of a key which is already queued only
+ * takes the map lock shared, so duplicate-heavy writers of the same shard don't serialize.
  */
-template<typename Key, typename Value, size_t N_SHARDS>
-using Queue_2LockSharded = Impl::Queue_2LockSharded::ShardArray<Key, Value, N_SHARDS>;
+template<typename Key, typename Value>
+using Queue_2LockSharded = Impl::Queue_2LockSharded::ShardArray<Key, Value>;
@@ -1,6 +1,7 @@
 #pragma once
 #include "BaseQueue.h"
 #include <optional>
+#include <vector>
 
 
 namespace Impl::Queue_2LockShardedUnlimited
@@ -47,19 +48,25 @@ public:
 	}
 };
 
-template<typename Key, typename Value, size_t N_SHARDS>
+template<typename Key, typename Value>
 class ShardArray : public BaseQueue<Key, Value>
 {
 private:
 	using BaseQ = BaseQueue<Key, Value>;
 	using typename BaseQ::KVPair;
 	
-	std::array<Shard<BaseQ>, N_SHARDS> m_shards;
+	std::vector<Shard<BaseQ>> m_shards;
+	const usize m_shardMask;
 	std::atomic<usize> m_readIndex, m_writeIndex;
 	std::atomic<usize> m_size;
 public:
-	ShardArray(const usize capacity)
+	constexpr static bool BOUNDED = false;
+	
+	/* `nShards` is rounded up to a power of 2. */
+	ShardArray(const usize capacity, const usize nShards = Utils::default_shard_count())
 		: BaseQ{ capacity }
+		, m_shards(Utils::ceil_pow2(nShards))
+		, m_shardMask{ static_cast<usize>(m_shards.size() - 1) }
 		, m_readIndex{ 0 }
 		, m_writeIndex{ 0 }
 		, m_size{ 0 }
@@ -69,34 +76,54 @@ public:
 		return m_size.load();
 	}
 	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
 	bool try_write(Key &&key, Value &&value) {
-		auto &shard = m_shards[m_writeIndex.fetch_add(1) % N_SHARDS];
+		m_size.fetch_add(1); // before inserting, so that a closed queue never looks empty too early
+		if (this->writes_closed()) {
+			m_size.fetch_sub(1);
+			throw Utils::queue_closed_exception{};
+		}
+		auto &shard = m_shards[m_writeIndex.fetch_add(1) & m_shardMask];
 		const bool inserted = shard.write(std::move(key), std::move(value));
-		if (inserted) {
-			m_size.fetch_add(1);
+		if (!inserted) {
+			m_size.fetch_sub(1);
 		}
 		return true;
 	}
 	
+	/* Returns `std::nullopt` instead of waiting when every shard is empty.
+	 * The shards are tried round-robin, starting after the one the previous read started at. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		const usize offset = m_readIndex.fetch_add(1);
+		for (usize i = 0; i < m_shards.size(); ++i) {
+			if (std::optional data = m_shards[(offset + i) & m_shardMask].try_read()) {
+				m_size.fetch_sub(1);
+				return data;
+			}
+		}
+		return std::nullopt;
+	}
+	
 	constexpr KVPair read() {
-		auto &shard = m_shards[m_readIndex.fetch_add(1) % N_SHARDS];
 		while (true) {
-			for (usize i = 0; i < N_SHARDS; ++i) { // several attempts
-				if (std::optional data = shard.try_read()) {
-					m_size.fetch_sub(1);
-					return *data;
-				}
+			if (std::optional data = try_read()) {
+				return *data;
 			}
 			
 			if (this->stopped()) {
 				throw Utils::queue_stopped_exception{};
 			}
-			Utils::sleep(WAIT_TIME);
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
 		}
 	}
 };
 
 }
 
-template<typename Key, typename Value, size_t N_SHARDS>
-using Queue_2LockShardedUnlimited = Impl::Queue_2LockShardedUnlimited::ShardArray<Key, Value, N_SHARDS>;
+template<typename Key, typename Value>
+using Queue_2LockShardedUnlimited = Impl::Queue_2LockShardedUnlimited::ShardArray<Key, Value>;
@@ -0,0 +1,315 @@
+#pragma once
+#include "BaseQueue.h"
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <vector>
+
+
+namespace Impl::Queue_AdaptiveSharded
+{
+
+struct ShardStats {
+	uint32_t nLocks = 0;
+	uint32_t nContended = 0;
+	uint32_t nEmptyReads = 0;
+};
+
+template<typename BaseQueue>
+class Shard
+{
+private:
+	using KVPair = typename BaseQueue::KVPair;
+	using Key = typename BaseQueue::key_type;
+	using Value = typename BaseQueue::value_type;
+	
+	Utils::Queue<typename std::map<Key, Value>::iterator> m_queue;
+	std::map<Key, Value> m_map;
+	std::mutex m_lock;
+	bool m_migrated = false;
+	std::atomic<uint32_t> m_nLocks = 0, m_nContended = 0, m_nEmptyReads = 0;
+	
+	[[nodiscard]] std::unique_lock<std::mutex> _lock() {
+		std::unique_lock<std::mutex> uniqueLock{ m_lock, std::try_to_lock };
+		if (!uniqueLock.owns_lock()) {
+			m_nContended.fetch_add(1, std::memory_order_relaxed);
+			uniqueLock.lock();
+		}
+		m_nLocks.fetch_add(1, std::memory_order_relaxed);
+		return uniqueLock;
+	}
+	
+	void _adopt(Key &&key, Value &&value) {
+		DECL_LOCK_GUARD(m_lock);
+		auto [iter, inserted] = m_map.insert_or_assign(std::move(key), std::move(value));
+		if (inserted) { m_queue.push(iter); }
+	}
+public:
+	Shard() = default;
+	
+	/* Returns `std::nullopt` without touching the arguments when the shard has been migrated,
+	 * otherwise whether the key was deduplicated. */
+	std::optional<bool> write(Key &&key, Value &&value, bool dedupOnly) {
+		std::unique_lock<std::mutex> uniqueLock = _lock();
+		if (m_migrated) { return std::nullopt; }
+		if (dedupOnly) {
+			auto iter = m_map.find(key);
+			if (iter == m_map.end()) {
+				return false;
+			}
+			iter->second = std::move(value);
+			return true;
+		}
+		auto [iter, inserted] = m_map.insert_or_assign(std::move(key), std::move(value));
+		if (inserted) { m_queue.push(iter); }
+		return !inserted;
+	}
+	
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		std::unique_lock<std::mutex> uniqueLock = _lock();
+		if (m_queue.empty()) {
+			m_nEmptyReads.fetch_add(1, std::memory_order_relaxed);
+			return std::nullopt;
+		}
+		return Utils::map_pop_iter(m_map, m_queue.pop());
+	}
+	
+	/* Moves every item into the shards of `table` in FIFO order, so that the items keep their
+	 * relative order, and marks this shard as migrated so that writers follow the items. */
+	template<typename Table>
+	void migrate_to(Table &table) {
+		DECL_LOCK_GUARD(m_lock);
+		while (!m_queue.empty()) {
+			auto [key, value] = Utils::map_pop_iter(m_map, m_queue.pop());
+			table.shard_of(key)._adopt(std::move(key), std::move(value));
+		}
+		m_migrated = true;
+	}
+	
+	/* Calls `fn(key, value)` for every queued item in FIFO order. */
+	template<typename Fn>
+	void visit(Fn &&fn) {
+		DECL_LOCK_GUARD(m_lock);
+		for (const auto &iter : m_queue) { fn(iter->first, iter->second); }
+	}
+	
+	ShardStats take_stats() {
+		ShardStats stats;
+		stats.nLocks = m_nLocks.exchange(0, std::memory_order_relaxed);
+		stats.nContended = m_nContended.exchange(0, std::memory_order_relaxed);
+		stats.nEmptyReads = m_nEmptyReads.exchange(0, std::memory_order_relaxed);
+		return stats;
+	}
+};
+
+template<typename BaseQueue>
+struct ShardTable
+{
+	std::vector<Shard<BaseQueue>> shards;
+	const usize mask;
+	
+	ShardTable(const usize nShards)
+		: shards(nShards)
+		, mask{ static_cast<usize>(nShards - 1) }
+	{}
+	
+	[[nodiscard]] Shard<BaseQueue>& shard_of(const typename BaseQueue::key_type &key) {
+		return shards[std::hash<typename BaseQueue::key_type>{}(key) & mask];
+	}
+};
+
+template<typename Key, typename Value>
+class ShardArray : public BaseQueue<Key, Value>
+{
+private:
+	using BaseQ = BaseQueue<Key, Value>;
+	using typename BaseQ::KVPair;
+	using Table = ShardTable<BaseQ>;
+	
+	constexpr static uint32_t EVALUATION_INTERVAL = 4096; // operations per thread
+	constexpr static uint32_t MIN_SAMPLE_LOCKS = 1024;
+	constexpr static uint32_t GROW_CONTENDED_PERCENT = 10;
+	constexpr static uint32_t SHRINK_CONTENDED_PERCENT = 1;
+	constexpr static uint32_t SHRINK_EMPTY_READS_PERCENT = 50;
+	
+	const usize m_minShards, m_maxShards;
+	// the pointers only change while `m_tableLock` is held exclusively,
+	// `m_nextTable` is only set while items are migrated to it
+	std::unique_ptr<Table> m_table, m_nextTable;
+	std::shared_mutex m_tableLock;
+	std::mutex m_reshardLock;
+	std::atomic<usize> m_size;
+	
+	[[nodiscard]] std::optional<KVPair> _try_read() {
+		std::shared_lock<std::shared_mutex> tableLock{ m_tableLock };
+		for (Table *table : { m_table.get(), m_nextTable.get() }) {
+			if (table == nullptr) { continue; }
+			for (auto &shard : table->shards) {
+				if (std::optional data = shard.try_read()) { return data; }
+			}
+		}
+		return std::nullopt;
+	}
+	
+	/* Counts the operations of the calling thread and periodically checks whether the
+	 * shard array should grow (lock contention) or shrink (readers mostly find empty shards). */
+	void _tick() {
+		thread_local uint32_t t_nOps = 0;
+		if (++t_nOps % EVALUATION_INTERVAL != 0) { return; }
+		
+		std::unique_lock<std::mutex> reshardLock{ m_reshardLock, std::try_to_lock };
+		if (!reshardLock.owns_lock()) { return; } // somebody else is on it
+		
+		ShardStats total;
+		usize nShards;
+		{
+			std::shared_lock<std::shared_mutex> tableLock{ m_tableLock };
+			nShards = m_table->shards.size();
+			for (auto &shard : m_table->shards) {
+				const ShardStats stats = shard.take_stats();
+				total.nLocks += stats.nLocks;
+				total.nContended += stats.nContended;
+				total.nEmptyReads += stats.nEmptyReads;
+			}
+		}
+		if (total.nLocks < MIN_SAMPLE_LOCKS) { return; }
+		
+		const uint64_t nLocks = total.nLocks;
+		if (uint64_t{ total.nContended } * 100 > nLocks * GROW_CONTENDED_PERCENT) {
+			if (nShards < m_maxShards) { _reshard(nShards * 2); }
+		}
+		else if (uint64_t{ total.nContended } * 100 < nLocks * SHRINK_CONTENDED_PERCENT
+			&& uint64_t{ total.nEmptyReads } * 100 > nLocks * SHRINK_EMPTY_READS_PERCENT)
+		{
+			if (nShards > m_minShards) { _reshard(nShards / 2); }
+		}
+	}
+	
+	/* Migrates shard by shard while holding `m_tableLock` shared, so writers and readers
+	 * only wait on the shard being migrated. `m_reshardLock` must be held. */
+	void _reshard(const usize nShards) {
+		{
+			std::unique_lock<std::shared_mutex> tableLock{ m_tableLock };
+			if (nShards == m_table->shards.size()) { return; }
+			m_nextTable = std::make_unique<Table>(nShards);
+		}
+		{
+			std::shared_lock<std::shared_mutex> tableLock{ m_tableLock };
+			for (auto &shard : m_table->shards) { shard.migrate_to(*m_nextTable); }
+		}
+		std::unique_lock<std::shared_mutex> tableLock{ m_tableLock };
+		m_table = std::move(m_nextTable);
+	}
+public:
+	/* All shard counts are rounded up to a power of 2. */
+	ShardArray(
+		const usize capacity,
+		const usize nShards = Utils::default_shard_count(),
+		const usize minShards = 1,
+		const usize maxShards = 8 * Utils::default_shard_count()
+	)
+		: BaseQ{ capacity }
+		, m_minShards{ static_cast<usize>(Utils::ceil_pow2(minShards)) }
+		, m_maxShards{ static_cast<usize>(Utils::ceil_pow2(std::max(maxShards, minShards))) }
+		, m_table{ std::make_unique<Table>(std::clamp<usize>(Utils::ceil_pow2(nShards), m_minShards, m_maxShards)) }
+		, m_nextTable{}
+		, m_size{ 0 }
+	{}
+	
+	[[nodiscard]] constexpr usize size() {
+		return m_size.load();
+	}
+	
+	[[nodiscard]] usize shard_count() {
+		std::shared_lock<std::shared_mutex> tableLock{ m_tableLock };
+		return m_table->shards.size();
+	}
+	
+	/* Writes the queued items to `path` with 1 section per shard, see 'Snapshot.h'.
+	 * Shards are copied one at a time, resharding waits until the snapshot is complete. */
+	void snapshot(const std::string &path) {
+		DECL_LOCK_GUARD(m_reshardLock);
+		std::shared_lock<std::shared_mutex> tableLock{ m_tableLock };
+		Snapshot::write_file<Key, Value>(path, m_table->shards.size(), [this](uint32_t index, auto &section) {
+			m_table->shards[index].visit(section);
+		});
+	}
+	
+	/* Writes the items of the snapshot at `path` to this queue, returns how many were accepted. */
+	usize restore(const std::string &path) { return Snapshot::restore(*this, path); }
+	
+	/* Keys with the same index share a shard whatever the current shard count is,
+	 * FIFO order only holds between them. */
+	[[nodiscard]] constexpr
+	usize fifo_index(const Key &key) const { return std::hash<Key>{}(key) & (m_maxShards - 1); }
+	
+	/* Grows or shrinks the shard array to `nShards` (rounded up to a power of 2 and clamped
+	 * to the configured bounds), blocking until the items have been migrated. */
+	void reshard(const usize nShards) {
+		DECL_LOCK_GUARD(m_reshardLock);
+		_reshard(std::clamp<usize>(Utils::ceil_pow2(nShards), m_minShards, m_maxShards));
+	}
+	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
+	bool try_write(Key &&key, Value &&value) {
+		const bool overflow = (m_size.fetch_add(1) >= this->capacity());
+		if (this->writes_closed()) { // after reserving, see `close_writes()`
+			m_size.fetch_sub(1);
+			throw Utils::queue_closed_exception{};
+		}
+		
+		bool deduped;
+		{
+			std::shared_lock<std::shared_mutex> tableLock{ m_tableLock };
+			std::optional result = m_table->shard_of(key).write(std::move(key), std::move(value), overflow);
+			if (!result.has_value()) { // the key's shard has been migrated already
+				result = m_nextTable->shard_of(key).write(std::move(key), std::move(value), overflow);
+			}
+			deduped = *result;
+		}
+		
+		if (overflow || deduped) {
+			m_size.fetch_sub(1);
+		}
+		_tick();
+		return !overflow || deduped;
+	}
+	
+	/* Returns `std::nullopt` instead of waiting when the queue is empty. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		std::optional data = _try_read();
+		_tick();
+		if (data.has_value()) {
+			m_size.fetch_sub(1);
+		}
+		return data;
+	}
+	
+	KVPair read() {
+		while (true) {
+			if (std::optional data = try_read()) {
+				return *data;
+			}
+			
+			if (this->stopped()) {
+				throw Utils::queue_stopped_exception{};
+			}
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
+		}
+	}
+};
+
+}
+
+/* Like the single-lock sharded implementation, but the number of shards follows the load:
+ * the array doubles when the shard locks are contended and halves when readers mostly
+ * find empty shards (e.g high duplication, where a few hot keys make most shards idle).
+ * Items are migrated one shard at a time, a migrated shard forwards writers to the new array.
+ */
+template<typename Key, typename Value>
+using Queue_AdaptiveSharded = Impl::Queue_AdaptiveSharded::ShardArray<Key, Value>;
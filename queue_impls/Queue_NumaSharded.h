@@ -0,0 +1,192 @@
+#pragma once
+#include "BaseQueue.h"
+#include "Numa.h"
+#include <memory>
+#include <optional>
+#include <vector>
+
+
+namespace Impl::Queue_NumaSharded
+{
+
+template<typename BaseQueue>
+class Shard
+{
+private:
+	using KVPair = typename BaseQueue::KVPair;
+	using Key = typename BaseQueue::key_type;
+	using Value = typename BaseQueue::value_type;
+	template<typename T>
+	using Allocator = Utils::Numa::ArenaAllocator<T>;
+	using Map = std::map<Key, Value, std::less<Key>, Allocator<std::pair<const Key, Value>>>;
+	using Iterator = typename Map::iterator;
+	
+	Map m_map;
+	Utils::Queue<Iterator, std::deque<Iterator, Allocator<Iterator>>> m_queue;
+	std::mutex m_lock;
+public:
+	Shard(Utils::Numa::Arena &arena)
+		: m_map{ Allocator<std::pair<const Key, Value>>{ arena } }
+		, m_queue{ Allocator<Iterator>{ arena } }
+	{}
+	
+	bool write(Key &&key, Value &&value, bool dedupOnly) {
+		DECL_LOCK_GUARD(m_lock);
+		if (dedupOnly) {
+			auto iter = m_map.find(key);
+			if (iter == m_map.end()) {
+				return false;
+			}
+			iter->second = std::move(value);
+			return true;
+		}
+		auto [iter, inserted] = m_map.insert_or_assign(std::move(key), std::move(value));
+		if (inserted) { m_queue.push(iter); }
+		return !inserted;
+	}
+	
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		DECL_LOCK_GUARD(m_lock);
+		if (m_queue.empty()) { return std::nullopt; }
+		return Utils::map_pop_iter(m_map, m_queue.pop());
+	}
+	
+	/* Calls `fn(key, value)` for every queued item in FIFO order. */
+	template<typename Fn>
+	void visit(Fn &&fn) {
+		DECL_LOCK_GUARD(m_lock);
+		for (const auto &iter : m_queue) { fn(iter->first, iter->second); }
+	}
+};
+
+template<typename Key, typename Value>
+class ShardArray : public BaseQueue<Key, Value>
+{
+private:
+	using BaseQ = BaseQueue<Key, Value>;
+	using typename BaseQ::KVPair;
+	using Shard = Impl::Queue_NumaSharded::Shard<BaseQ>;
+	static_assert(alignof (Shard) <= Utils::Numa::Arena::ALIGN);
+	
+	const Utils::Numa::Topology m_topology;
+	std::vector<std::unique_ptr<Utils::Numa::Arena>> m_arenas; // 1 per shard, so shards never share a page
+	std::vector<Shard*> m_shards; // allocated from their arena
+	const usize m_shardMask;
+	std::atomic<usize> m_size;
+	
+	[[nodiscard]] constexpr static
+	usize _index_from_key(const Key &key) { return std::hash<Key>{}(key); }
+public:
+	/* `nShards` is rounded up to a power of 2, shard `i` is placed on node `i % node_count()`. */
+	ShardArray(const usize capacity,
+		const usize nShards = Utils::default_shard_count(),
+		const Utils::Numa::Topology &topology = Utils::Numa::Topology::system()
+	)
+		: BaseQ{ capacity }
+		, m_topology{ topology }
+		, m_shardMask{ static_cast<usize>(Utils::ceil_pow2(nShards) - 1) }
+		, m_size{ 0 }
+	{
+		for (usize i = 0; i <= m_shardMask; ++i) {
+			m_arenas.push_back(std::make_unique<Utils::Numa::Arena>(m_topology, shard_node(i)));
+			m_shards.push_back(new (m_arenas[i]->allocate(sizeof (Shard))) Shard{ *m_arenas[i] });
+		}
+	}
+	
+	ShardArray(const ShardArray&) = delete;
+	ShardArray& operator=(const ShardArray&) = delete;
+	
+	~ShardArray() {
+		for (usize i = 0; i < m_shards.size(); ++i) {
+			m_shards[i]->~Shard();
+			m_arenas[i]->deallocate(m_shards[i], sizeof (Shard));
+		}
+	}
+	
+	[[nodiscard]] constexpr usize size() {
+		return m_size.load();
+	}
+	
+	[[nodiscard]] usize shard_count() const { return m_shards.size(); }
+	[[nodiscard]] const Utils::Numa::Topology& topology() const { return m_topology; }
+	
+	/* Writes the queued items to `path` with 1 section per shard, see 'Snapshot.h'. */
+	void snapshot(const std::string &path) {
+		Snapshot::write_file<Key, Value>(path, m_shards.size(), [this](uint32_t index, auto &section) {
+			m_shards[index]->visit(section);
+		});
+	}
+	
+	/* Writes the items of the snapshot at `path` to this queue, returns how many were accepted. */
+	usize restore(const std::string &path) { return Snapshot::restore(*this, path); }
+	[[nodiscard]] usize shard_node(const usize shard) const { return shard % m_topology.node_count(); }
+	
+	/* Node whose memory holds `key` once it's queued. */
+	[[nodiscard]] usize node_of(const Key &key) const { return shard_node(fifo_index(key)); }
+	
+	/* Index of the shard `key` is queued in, FIFO order only holds within a shard. */
+	[[nodiscard]] constexpr
+	usize fifo_index(const Key &key) const { return _index_from_key(key) & m_shardMask; }
+	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
+	bool try_write(Key &&key, Value &&value) {
+		const bool overflow = (m_size.fetch_add(1) >= this->capacity());
+		if (this->writes_closed()) { // after reserving, see `close_writes()`
+			m_size.fetch_sub(1);
+			throw Utils::queue_closed_exception{};
+		}
+		
+		Shard &shard = *m_shards[fifo_index(key)];
+		const bool deduped = shard.write(std::move(key), std::move(value), overflow);
+		
+		if (overflow || deduped) {
+			m_size.fetch_sub(1);
+		}
+		return !overflow || deduped;
+	}
+	
+	/* Returns `std::nullopt` instead of waiting when the queue is empty.
+	 * The shards of the caller's node are tried first, then those of the next nodes. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		const usize nNodes = m_topology.node_count();
+		const usize local = Utils::Numa::current_node(m_topology);
+		for (usize n = 0; n < nNodes; ++n) {
+			for (usize i = (local + n) % nNodes; i < m_shards.size(); i += nNodes) {
+				if (std::optional data = m_shards[i]->try_read()) {
+					m_size.fetch_sub(1);
+					return data;
+				}
+			}
+		}
+		return std::nullopt;
+	}
+	
+	constexpr KVPair read() {
+		while (true) {
+			if (std::optional data = try_read()) {
+				return *data;
+			}
+			
+			if (this->stopped()) {
+				throw Utils::queue_stopped_exception{};
+			}
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
+		}
+	}
+};
+
+}
+
+/* `Queue_1LockSharded` with every shard placed on a NUMA node, see 'Numa.h': the shard
+ * itself, its map nodes and its FIFO are allocated from an arena bound to the node.
+ * Writers go to the shard of their key (deduplication needs a single shard per key),
+ * readers try the shards of their own node first. Keys and values which allocate
+ * (like `std::string`) still allocate their data with the writer's allocator.
+ */
+template<typename Key, typename Value>
+using Queue_NumaSharded = Impl::Queue_NumaSharded::ShardArray<Key, Value>;
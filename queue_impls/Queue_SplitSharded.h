@@ -1,6 +1,7 @@
 #pragma once
 #include "BaseQueue.h"
 #include <optional>
+#include <vector>
 
 
 namespace Impl::Queue_SplitSharded
@@ -19,7 +20,7 @@ struct PairedMutex
 };
 
 
-template<typename Key, typename Value, size_t N_SHARDS>
+template<typename Key, typename Value>
 class ShardArray : public BaseQueue<Key, Value>
 {
 private:
@@ -32,8 +33,9 @@ private:
 		usize _index;
 	};
 	
-	std::array<PairedMutex<Utils::Queue<MapItemRef>>, 4> m_queues;
-	std::array<PairedMutex<Map>, N_SHARDS> m_maps;
+	std::vector<PairedMutex<Utils::Queue<MapItemRef>>> m_queues;
+	std::vector<PairedMutex<Map>> m_maps;
+	const usize m_queueMask, m_mapMask;
 	std::atomic<usize> m_size;
 	
 	[[nodiscard]] constexpr static
@@ -45,9 +47,25 @@ private:
 		if (queue._data.empty()) { return std::nullopt; }
 		return queue._data.pop();
 	}
+	
+	/* Readers start scanning at a different queue every time (and from every thread)
+	 * so that the first queues aren't drained more eagerly than the last ones. */
+	[[nodiscard]] static usize _next_read_offset() {
+		thread_local usize t_offset = std::hash<std::thread::id>{}(std::this_thread::get_id());
+		return t_offset++;
+	}
 public:
-	ShardArray(const usize capacity)
+	/* `nShards` (maps) and `nQueues` are tuned independently and are rounded up to a power of 2. */
+	ShardArray(
+		const usize capacity,
+		const usize nShards = Utils::default_shard_count(),
+		const usize nQueues = Utils::default_shard_count()
+	)
 		: BaseQ{ capacity }
+		, m_queues(Utils::ceil_pow2(nQueues))
+		, m_maps(Utils::ceil_pow2(nShards))
+		, m_queueMask{ static_cast<usize>(m_queues.size() - 1) }
+		, m_mapMask{ static_cast<usize>(m_maps.size() - 1) }
 		, m_size{ 0 }
 	{}
 	
@@ -55,11 +73,46 @@ public:
 		return m_size.load();
 	}
 	
+	[[nodiscard]] usize shard_count() const { return m_maps.size(); }
+	[[nodiscard]] usize queue_count() const { return m_queues.size(); }
+	
+	/* Writes the queued items to `path` with 1 section per queue, see 'Snapshot.h'.
+	 * Queues are copied one at a time, so writers only wait for the queue being copied. */
+	void snapshot(const std::string &path) {
+		Snapshot::write_file<Key, Value>(path, m_queues.size(), [this](uint32_t index, auto &section) {
+			auto &queue = m_queues[index];
+			DECL_LOCK_GUARD(queue._lock);
+			for (const MapItemRef &ref : queue._data) {
+				PairedMutex<Map> &shard = m_maps[ref._index];
+				DECL_LOCK_GUARD(shard._lock);
+				section(ref._iter->first, ref._iter->second);
+			}
+		});
+	}
+	
+	/* Writes the items of the snapshot at `path` to this queue, returns how many were accepted. */
+	usize restore(const std::string &path) { return Snapshot::restore(*this, path); }
+	
+	/* Index of the queue `key` is pushed to, FIFO order only holds within a queue.
+	 * Writers pick the queue from the key's hash so that the queues get equal shares
+	 * of the maps when there are fewer queues than maps, and of the keys otherwise. */
+	[[nodiscard]] constexpr
+	usize fifo_index(const Key &key) const { return _index_from_key(key) & m_queueMask; }
+	
+	/* Blocks until readers have emptied the queue, returns `false` if `stop_now()` is called first. */
+	bool drain() { return this->_drain([this]() { return size(); }); }
+	
 	bool try_write(const Key &key, const Value &value) {
-		const usize index = _index_from_key(key) % N_SHARDS;
+		const usize hash = _index_from_key(key);
+		const usize index = hash & m_mapMask;
 		PairedMutex<Map> &shard = m_maps[index];
 		
-		if (m_size.fetch_add(1) >= this->capacity()) {
+		const bool overflow = (m_size.fetch_add(1) >= this->capacity());
+		if (this->writes_closed()) { // after reserving, see `close_writes()`
+			m_size.fetch_sub(1);
+			throw Utils::queue_closed_exception{};
+		}
+		if (overflow) {
 			m_size.fetch_sub(1);
 			
 			DECL_LOCK_GUARD(shard._lock);
@@ -74,7 +127,7 @@ public:
 		std::unique_lock<std::mutex> uniqueLock{ shard._lock };
 		if (auto [iter, inserted] = shard._data.insert_or_assign(key, value); inserted) {
 			uniqueLock.unlock();
-			auto &queue = m_queues[index % m_queues.size()];
+			auto &queue = m_queues[hash & m_queueMask];
 			DECL_LOCK_GUARD(queue._lock);
 			queue._data.push({ iter, index });
 		}
@@ -84,22 +137,34 @@ public:
 		return true;
 	}
 	
+	/* Returns `std::nullopt` instead of waiting when the queue is empty. */
+	[[nodiscard]] std::optional<KVPair> try_read() {
+		const usize offset = _next_read_offset();
+		for (usize i = 0; i < m_queues.size(); ++i) {
+			std::optional<MapItemRef> opt = _locked_queue_pop(m_queues[(offset + i) & m_queueMask]);
+			if (!opt.has_value()) { continue; }
+			
+			m_size.fetch_sub(1);
+			PairedMutex<Map> &shard = m_maps[opt->_index];
+			DECL_LOCK_GUARD(shard._lock);
+			return Utils::map_pop_iter(shard._data, opt->_iter);
+		}
+		return std::nullopt;
+	}
+	
 	KVPair read() {
 		while (true) {
-			for (auto &queue : m_queues) {
-				std::optional<MapItemRef> opt = _locked_queue_pop(queue);
-				if (!opt.has_value()) { continue; }
-				
-				m_size.fetch_sub(1);
-				PairedMutex<Map> &shard = m_maps[opt->_index];
-				DECL_LOCK_GUARD(shard._lock);
-				return Utils::map_pop_iter(shard._data, opt->_iter);
+			if (std::optional data = try_read()) {
+				return *data;
 			}
 			
 			if (this->stopped()) {
 				throw Utils::queue_stopped_exception{};
 			}
-			Utils::sleep(WAIT_TIME);
+			if (this->writes_closed() && size() == 0) {
+				throw Utils::queue_closed_exception{};
+			}
+			this->_wait();
 		}
 	}
 };
@@ -107,9 +172,9 @@ public:
 }
 
 /* An array of deduplication maps that never compete and each have 1 lock.
- * There is a single queue which holds the key and an index to the right map.
+ * A separate array of queues holds the map iterators and an index to the right map.
  *
  * Similar to the double-lock implementation, which lets the queue and map be locked separately.
  */
-template<typename Key, typename Value, size_t N_SHARDS>
-using Queue_SplitSharded = Impl::Queue_SplitSharded::ShardArray<Key, Value, N_SHARDS>;
+template<typename Key, typename Value>
+using Queue_SplitSharded = Impl::Queue_SplitSharded::ShardArray<Key, Value>;
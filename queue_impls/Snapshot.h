@@ -0,0 +1,262 @@
+#pragma once
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace Utils
+{
+	class snapshot_format_exception : public std::runtime_error
+	{
+	public:
+		snapshot_format_exception(const std::string &path, const char *reason)
+			: std::runtime_error{ "Invalid snapshot '" + path + "': " + reason }
+		{}
+		
+		virtual ~snapshot_format_exception() {};
+	};
+	
+	/* Binary encoding of keys and values.
+	 * Trivially copyable types are copied as they are, other types need a specialization.
+	 * `read()` returns `false` when the input is too short.
+	 */
+	template<typename T, typename = void>
+	struct Serializer
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "Specialize `Utils::Serializer` for this type");
+		
+		static void write(std::string &out, const T &value) {
+			out.append(reinterpret_cast<const char*>(&value), sizeof (T));
+		}
+		
+		[[nodiscard]] static bool read(const char *&pos, const char *end, T &value) {
+			if (size_t(end - pos) < sizeof (T)) { return false; }
+			memcpy(&value, pos, sizeof (T));
+			pos += sizeof (T);
+			return true;
+		}
+	};
+	
+	template<>
+	struct Serializer<std::string>
+	{
+		static void write(std::string &out, const std::string &value) {
+			Serializer<uint32_t>::write(out, static_cast<uint32_t>(value.size()));
+			out.append(value);
+		}
+		
+		[[nodiscard]] static bool read(const char *&pos, const char *end, std::string &value) {
+			uint32_t size;
+			if (!Serializer<uint32_t>::read(pos, end, size) || size_t(end - pos) < size) { return false; }
+			value.assign(pos, size);
+			pos += size;
+			return true;
+		}
+	};
+}
+
+/* Snapshots of the items in a queue.
+ *
+ * The file starts with a header followed by 1 section per shard (or FIFO) of the queue,
+ * each section holds the items of the shard in FIFO order:
+ *   header:  char magic[8] = "DDQSNAP", uint32_t version, uint32_t nSections
+ *   section: uint64_t nItems, uint64_t nBytes, followed by nBytes of items
+ *   item:    key and value encoded with `Utils::Serializer`
+ * The section sizes allow skipping through a memory-mapped file without parsing the items.
+ */
+namespace Snapshot
+{
+	constexpr char MAGIC[8] = "DDQSNAP";
+	constexpr uint32_t VERSION = 1;
+	
+	/* Collects the items of 1 section, given to the section callback of `write_file()`. */
+	template<typename Key, typename Value>
+	class SectionWriter
+	{
+	private:
+		std::string m_bytes;
+		uint64_t m_nItems = 0;
+	public:
+		void operator()(const Key &key, const Value &value) {
+			Utils::Serializer<Key>::write(m_bytes, key);
+			Utils::Serializer<Value>::write(m_bytes, value);
+			++m_nItems;
+		}
+		
+		[[nodiscard]] const std::string& bytes() const { return m_bytes; }
+		[[nodiscard]] uint64_t item_count() const { return m_nItems; }
+		
+		void clear() {
+			m_bytes.clear();
+			m_nItems = 0;
+		}
+	};
+	
+	/* Temporary file of `write_file()`, closed and removed unless `commit()` renamed it. */
+	class TmpFile
+	{
+	private:
+		const std::string m_path;
+		const std::string m_tmpPath;
+		FILE *m_file;
+		bool m_committed = false;
+		
+		[[noreturn]] static void _throw_errno(const int error, const std::string &what) {
+			throw std::system_error{ error, std::generic_category(), what };
+		}
+	public:
+		TmpFile(const std::string &path)
+			: m_path{ path }
+			, m_tmpPath{ path + ".tmp" }
+			, m_file{ fopen(m_tmpPath.c_str(), "wb") }
+		{
+			if (m_file == nullptr) { _throw_errno(errno, "fopen(" + m_tmpPath + ")"); }
+		}
+		
+		TmpFile(const TmpFile&) = delete;
+		TmpFile& operator=(const TmpFile&) = delete;
+		
+		~TmpFile() {
+			if (m_file != nullptr) { fclose(m_file); }
+			if (!m_committed) { unlink(m_tmpPath.c_str()); }
+		}
+		
+		void write(const void *data, const size_t size) {
+			if (fwrite(data, 1, size, m_file) != size) { _throw_errno(errno, "fwrite(" + m_tmpPath + ")"); }
+		}
+		
+		/* Syncs the file, renames it to the final path and syncs the directory holding it. */
+		void commit() {
+			if (fflush(m_file) != 0 || fsync(fileno(m_file)) != 0) { _throw_errno(errno, "fsync(" + m_tmpPath + ")"); }
+			const int closeResult = fclose(m_file);
+			m_file = nullptr;
+			if (closeResult != 0) { _throw_errno(errno, "fclose(" + m_tmpPath + ")"); }
+			if (rename(m_tmpPath.c_str(), m_path.c_str()) != 0) { _throw_errno(errno, "rename(" + m_path + ")"); }
+			m_committed = true;
+			
+			const size_t slash = m_path.rfind('/');
+			const std::string directory = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : m_path.substr(0, slash);
+			const int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd < 0) { _throw_errno(errno, "open(" + directory + ")"); }
+			const int syncResult = fsync(fd);
+			const int error = errno;
+			close(fd);
+			if (syncResult != 0) { _throw_errno(error, "fsync(" + directory + ")"); }
+		}
+	};
+	
+	/* Writes `nSections` sections, calling `fillSection(index, SectionWriter&)` for each one.
+	 * Every section is written out before the next one is filled, so a queue only needs to
+	 * lock 1 shard at a time. The file is written next to `path` and renamed when complete.
+	 */
+	template<typename Key, typename Value, typename Fn>
+	void write_file(const std::string &path, const uint32_t nSections, Fn &&fillSection) {
+		TmpFile file{ path };
+		file.write(MAGIC, sizeof (MAGIC));
+		file.write(&VERSION, sizeof (VERSION));
+		file.write(&nSections, sizeof (nSections));
+		
+		SectionWriter<Key, Value> section;
+		for (uint32_t i = 0; i < nSections; ++i) {
+			section.clear();
+			fillSection(i, section);
+			
+			const uint64_t nItems = section.item_count();
+			const uint64_t nBytes = section.bytes().size();
+			file.write(&nItems, sizeof (nItems));
+			file.write(&nBytes, sizeof (nBytes));
+			file.write(section.bytes().data(), nBytes);
+		}
+		file.commit();
+	}
+	
+	/* Memory-maps `path` and calls `onItem(Key&&, Value&&)` for every item, section by section.
+	 * Throws `Utils::snapshot_format_exception` when the file is truncated or not a snapshot.
+	 */
+	template<typename Key, typename Value, typename Fn>
+	void read_file(const std::string &path, Fn &&onItem) {
+		const int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::system_error{ errno, std::generic_category(), "open(" + path + ")" };
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0) {
+			const int error = errno;
+			close(fd);
+			throw std::system_error{ error, std::generic_category(), "fstat(" + path + ")" };
+		}
+		
+		const size_t size = static_cast<size_t>(info.st_size);
+		void *data = (size == 0) ? nullptr : mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			throw std::system_error{ errno, std::generic_category(), "mmap(" + path + ")" };
+		}
+		if (data != nullptr) { madvise(data, size, MADV_SEQUENTIAL); }
+		
+		struct Unmap {
+			void *data;
+			size_t size;
+			~Unmap() { if (data != nullptr) { munmap(data, size); } }
+		} unmap{ data, size };
+		
+		const char *pos = static_cast<const char*>(data);
+		const char *const end = pos + size;
+		
+		char magic[sizeof (MAGIC)];
+		uint32_t version, nSections;
+		if (size < sizeof (magic) || memcmp(pos, MAGIC, sizeof (MAGIC)) != 0) {
+			throw Utils::snapshot_format_exception{ path, "bad magic" };
+		}
+		pos += sizeof (magic);
+		if (!Utils::Serializer<uint32_t>::read(pos, end, version) || version != VERSION) {
+			throw Utils::snapshot_format_exception{ path, "unsupported version" };
+		}
+		if (!Utils::Serializer<uint32_t>::read(pos, end, nSections)) {
+			throw Utils::snapshot_format_exception{ path, "truncated header" };
+		}
+		
+		for (uint32_t i = 0; i < nSections; ++i) {
+			uint64_t nItems, nBytes;
+			if (!Utils::Serializer<uint64_t>::read(pos, end, nItems)
+				|| !Utils::Serializer<uint64_t>::read(pos, end, nBytes)
+				|| uint64_t(end - pos) < nBytes)
+			{
+				throw Utils::snapshot_format_exception{ path, "truncated section" };
+			}
+			
+			const char *const sectionEnd = pos + nBytes;
+			for (uint64_t n = 0; n < nItems; ++n) {
+				Key key;
+				Value value;
+				if (!Utils::Serializer<Key>::read(pos, sectionEnd, key)
+					|| !Utils::Serializer<Value>::read(pos, sectionEnd, value))
+				{
+					throw Utils::snapshot_format_exception{ path, "truncated item" };
+				}
+				onItem(std::move(key), std::move(value));
+			}
+			pos = sectionEnd;
+		}
+	}
+	
+	/* Writes every item of the snapshot at `path` to `queue`, returns how many were accepted. */
+	template<typename Queue>
+	size_t restore(Queue &queue, const std::string &path) {
+		size_t nRestored = 0;
+		read_file<typename Queue::key_type, typename Queue::value_type>(path,
+			[&queue, &nRestored](auto &&key, auto &&value) {
+				nRestored += queue.try_write(std::move(key), std::move(value));
+			}
+		);
+		return nRestored;
+	}
+}
@@ -1,10 +1,13 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <map>
 #include <mutex>
 #include <queue>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
 
 #define CONCAT__(a, b) a##b
@@ -21,16 +24,72 @@ namespace Utils
 	template<typename T>
 	using remove_cvref_t = std::remove_cv_t<std::remove_reference_t<T>>;
 	
+	/* Smallest power of 2 which is not less than `value`. */
+	[[nodiscard]] constexpr
+	size_t ceil_pow2(const size_t value) {
+		size_t result = 1;
+		while (result < value) { result <<= 1; }
+		return result;
+	}
+	
 	class queue_stopped_exception : public std::runtime_error
 	{
 	public:
-		queue_stopped_exception()
-			: std::runtime_error{ "Queue has been stopped already" }
+		queue_stopped_exception(const char *what = "Queue has been stopped already")
+			: std::runtime_error{ what }
 		{}
 		
 		virtual ~queue_stopped_exception() {};
 	};
 	
+	/* Thrown by writers after `close_writes()`, and by readers once such a queue is empty.
+	 * Reader loops which end on `queue_stopped_exception` also end on a drained queue. */
+	class queue_closed_exception : public queue_stopped_exception
+	{
+	public:
+		queue_closed_exception()
+			: queue_stopped_exception{ "Queue has been closed for writes" }
+		{}
+		
+		virtual ~queue_closed_exception() {};
+	};
+	
+	/* Shared mutex made of a `std::mutex` and a reader count, for short shared sections.
+	 * The exclusive side costs about as much as a plain `std::mutex` (`std::shared_mutex`
+	 * made the insert-heavy benchmark about twice as slow), and the shared side only
+	 * increments the count while no exclusive owner is waiting or holding the mutex.
+	 * Works with `std::lock_guard`, `std::unique_lock` and `std::shared_lock`.
+	 */
+	class ReadMostlyMutex
+	{
+	private:
+		std::mutex m_lock; // held by the exclusive owner
+		std::atomic<bool> m_exclusive{ false };
+		std::atomic<uint32_t> m_nShared{ 0 };
+	public:
+		void lock() {
+			m_lock.lock();
+			m_exclusive.store(true); // before checking the readers, which check it after registering
+			while (m_nShared.load() != 0) { std::this_thread::yield(); }
+		}
+		
+		void unlock() {
+			m_exclusive.store(false);
+			m_lock.unlock();
+		}
+		
+		void lock_shared() {
+			while (true) {
+				m_nShared.fetch_add(1);
+				if (!m_exclusive.load()) { return; }
+				m_nShared.fetch_sub(1);
+				std::lock_guard<std::mutex> lockGuard{ m_lock }; // waits for the exclusive owner
+			}
+		}
+		
+		void unlock_shared() { m_nShared.fetch_sub(1); }
+	};
+	
 	/* `std::queue` with iterators. */
 	template<typename ...Args>
 	class Queue : public std::queue<Args...>
@@ -53,6 +112,50 @@ namespace Utils
 		}
 	};
 	
+	/* FIFO ring buffer which doubles its storage when full.
+	 * Unlike `std::deque` it doesn't allocate while its size stays below the largest size so far.
+	 */
+	template<typename T>
+	class RingQueue
+	{
+	private:
+		std::vector<T> m_items; // size is a power of 2
+		size_t m_head, m_size;
+		
+		void _grow() {
+			std::vector<T> items(m_items.size() * 2);
+			for (size_t i = 0; i < m_size; ++i) { items[i] = std::move((*this)[i]); }
+			m_items = std::move(items);
+			m_head = 0;
+		}
+	public:
+		RingQueue(const size_t capacity = 16)
+			: m_items(ceil_pow2(std::max<size_t>(capacity, 1)))
+			, m_head{ 0 }
+			, m_size{ 0 }
+		{}
+		
+		[[nodiscard]] constexpr bool empty() const { return m_size == 0; }
+		[[nodiscard]] constexpr size_t size() const { return m_size; }
+		
+		/* Item at `index` counted from the front. */
+		[[nodiscard]] constexpr T& operator[](const size_t index) {
+			return m_items[(m_head + index) & (m_items.size() - 1)];
+		}
+		
+		void push(T item) {
+			if (m_size == m_items.size()) { _grow(); }
+			(*this)[m_size++] = std::move(item);
+		}
+		
+		[[nodiscard]] T pop() {
+			T item = std::move(m_items[m_head]);
+			m_head = (m_head + 1) & (m_items.size() - 1);
+			--m_size;
+			return item;
+		}
+	};
+	
 	template<typename T>
 	struct ReverseIterationAdaptor
 	{
@@ -83,9 +186,15 @@ namespace Utils
 		std::this_thread::sleep_for(time);
 	}
 	
-	template<typename K, typename V>
+	/* Shard count used when none is given: 1 shard per hardware thread, rounded up to a power of 2. */
+	[[nodiscard]] inline
+	size_t default_shard_count() {
+		return ceil_pow2(std::max(std::thread::hardware_concurrency(), 1u));
+	}
+	
+	template<typename K, typename V, typename ...Args>
 	[[nodiscard]] constexpr
-	auto map_pop_iter(std::map<K, V> &map, typename std::map<K, V>::iterator iter) {
+	auto map_pop_iter(std::map<K, V, Args...> &map, typename std::map<K, V, Args...>::iterator iter) {
 		std::pair result { std::move(iter->first), std::move(iter->second) };
 		map.erase(iter);
 		return result;